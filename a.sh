@@ -1,7 +1,41 @@
 #!/bin/bash
 
-g++ -std=c++17 -o a main.cpp handlers.cpp http_response.cpp utils.cpp logging.cpp \
-    -Wall -Wextra -O2 -D_POSIX_C_SOURCE=200809L
+# The in-process WebP encoder is built when libwebp is available; each input
+# decoder is added if its library is present. Without libwebp the server
+# falls back to compressor.sh for every upload.
+CODEC_FLAGS=""
+CODEC_LIBS=""
+if pkg-config --exists libwebp; then
+    CODEC_FLAGS="-DIMAGECURRY_WITH_WEBP $(pkg-config --cflags libwebp)"
+    CODEC_LIBS="$(pkg-config --libs libwebp)"
+
+    if pkg-config --exists libjpeg; then
+        CODEC_FLAGS="$CODEC_FLAGS -DIMAGECURRY_WITH_JPEG $(pkg-config --cflags libjpeg)"
+        CODEC_LIBS="$CODEC_LIBS $(pkg-config --libs libjpeg)"
+    fi
+
+    if pkg-config --exists libpng; then
+        CODEC_FLAGS="$CODEC_FLAGS -DIMAGECURRY_WITH_PNG $(pkg-config --cflags libpng)"
+        CODEC_LIBS="$CODEC_LIBS $(pkg-config --libs libpng)"
+    fi
+
+    if echo '#include <gif_lib.h>' | g++ -E -x c++ - > /dev/null 2>&1; then
+        CODEC_FLAGS="$CODEC_FLAGS -DIMAGECURRY_WITH_GIF"
+        CODEC_LIBS="$CODEC_LIBS -lgif"
+    fi
+fi
+
+# The io_uring engine talks to the kernel directly and only needs headers new
+# enough to describe provided buffer rings (Linux 5.19).
+ENGINE_FLAGS=""
+if printf '#include <linux/io_uring.h>\nint x = IORING_REGISTER_PBUF_RING;\n' | \
+        g++ -fsyntax-only -x c++ - > /dev/null 2>&1; then
+    ENGINE_FLAGS="-DIMAGECURRY_WITH_IO_URING"
+fi
+
+g++ -std=c++17 -pthread -o a main.cpp config.cpp event_loop.cpp uring_loop.cpp connection.cpp handlers.cpp \
+    http_request.cpp http_response.cpp chunked_decoder.cpp loop_notifier.cpp upload_sink.cpp sha256.cpp job_journal.cpp child_supervisor.cpp compression_helper.cpp object_cache.cpp compression.cpp image_codec.cpp utils.cpp logging.cpp \
+    -Wall -Wextra -O2 -D_POSIX_C_SOURCE=200809L $ENGINE_FLAGS $CODEC_FLAGS $CODEC_LIBS
 
 if [ $? -eq 0 ]; then
     echo "Compilation successful! Executable created: a"
@@ -0,0 +1,265 @@
+#include "child_supervisor.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+namespace ImageCurry {
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ChildSupervisor& ChildSupervisor::get_instance() {
+    static ChildSupervisor instance;
+    return instance;
+}
+
+ChildSupervisor::~ChildSupervisor() {
+    stop();
+}
+
+bool ChildSupervisor::block_sigchld() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    return pthread_sigmask(SIG_BLOCK, &set, nullptr) == 0;
+}
+
+bool ChildSupervisor::start() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd < 0 || wake_fd < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Child supervisor disabled, helper timeouts are not enforced: " +
+                std::string(strerror(errno)));
+        if (signal_fd >= 0) close(signal_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        signal_fd = wake_fd = -1;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = false;
+    running = true;
+    reaper = std::thread(&ChildSupervisor::reaper_loop, this);
+    return true;
+}
+
+// The encoder threads are stopped first, so no child is left to wait for.
+void ChildSupervisor::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        stopping = true;
+    }
+    uint64_t one = 1;
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+    reaper.join();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    close(signal_fd);
+    close(wake_fd);
+    signal_fd = wake_fd = -1;
+}
+
+// The child leads its own process group, so a kill reaches the programs it
+// starts too. Setting the group from both sides closes the race with a kill
+// sent before the child runs. The child is also killed if the thread that
+// forked it dies, which only happens when the whole process does: run()
+// blocks until the child has exited.
+pid_t ChildSupervisor::spawn(const char* const* argv, const char* dir) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) {
+            _exit(127);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0);
+        if (chdir(dir) != 0) {
+            _exit(127);
+        }
+
+        execv(argv[0], const_cast<char* const*>(argv));
+        _exit(127);
+    }
+    if (pid > 0) {
+        setpgid(pid, pid);
+    }
+    return pid;
+}
+
+ChildResult ChildSupervisor::run(const char* const* argv, const char* dir, int timeout,
+                                 const std::function<void(pid_t)>& on_start) {
+    ChildResult result;
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running) {
+        lock.unlock();
+        pid_t pid = spawn(argv, dir);
+        if (pid > 0) {
+            result.started = true;
+            if (on_start) on_start(pid);
+            while (waitpid(pid, &result.status, 0) < 0 && errno == EINTR) {}
+        } else {
+            result.error = errno;
+        }
+        record(result);
+        return result;
+    }
+
+    // Registered before the lock is released, so the reaper cannot miss an
+    // exit that happens straight after fork().
+    pid_t pid = spawn(argv, dir);
+    if (pid < 0) {
+        result.error = errno;
+        lock.unlock();
+        record(result);
+        return result;
+    }
+    children.emplace(pid, Child{now_ms() + timeout * 1000LL});
+    uint64_t one = 1;       // the reaper picks up the new deadline
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+    if (on_start) {
+        lock.unlock();
+        on_start(pid);
+        lock.lock();
+    }
+    exited.wait(lock, [&] { return children.at(pid).done; });
+
+    const Child& child = children.at(pid);
+    result.started = true;
+    result.status = child.status;
+    result.timed_out = child.timed_out;
+    children.erase(pid);
+    lock.unlock();
+
+    record(result);
+    return result;
+}
+
+void ChildSupervisor::record(const ChildResult& result) {
+    if (!result.started) {
+        fork_failed++;
+        return;
+    }
+    started++;
+    if (result.timed_out) {
+        timed_out++;
+    } else if (result.ok()) {
+        succeeded++;
+    } else {
+        failed++;
+    }
+}
+
+ChildCounters ChildSupervisor::counters() const {
+    return ChildCounters{started.load(), succeeded.load(), failed.load(),
+                         timed_out.load(), fork_failed.load()};
+}
+
+void ChildSupervisor::reaper_loop() {
+    int wait_ms = -1;
+    while (true) {
+        struct pollfd fds[2] = {{signal_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, wait_ms) < 0 && errno != EINTR) {
+            log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                    "Child supervisor poll failed: " + std::string(strerror(errno)));
+        }
+
+        // SIGCHLDs coalesce, so the signalfd only says that some child
+        // changed state; every known child is polled with WNOHANG.
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {}
+        uint64_t value;
+        ssize_t ignored = read(wake_fd, &value, sizeof(value));
+        (void)ignored;
+
+        reap();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping && children.empty()) {
+            return;
+        }
+        wait_ms = enforce_deadlines();
+    }
+}
+
+// A timed-out child may exit on SIGTERM while what it started ignores it.
+// Its group is killed before it is reaped: until then the zombie holds the
+// pid, so the group id cannot have been reused.
+void ChildSupervisor::reap() {
+    bool any = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry : children) {
+            Child& child = entry.second;
+            if (child.done) {
+                continue;
+            }
+            siginfo_t info = {};
+            if (waitid(P_PID, entry.first, &info, WEXITED | WNOHANG | WNOWAIT) != 0 ||
+                info.si_pid != entry.first) {
+                continue;
+            }
+            if (child.terminated) {
+                kill(-entry.first, SIGKILL);
+            }
+            waitpid(entry.first, &child.status, 0);
+            child.done = true;
+            any = true;
+        }
+    }
+    if (any) {
+        exited.notify_all();
+    }
+}
+
+// Called with the lock held. Returns how long to sleep until the next
+// deadline, or -1 if there is none.
+int ChildSupervisor::enforce_deadlines() {
+    int64_t now = now_ms();
+    int64_t next = -1;
+    for (auto& entry : children) {
+        Child& child = entry.second;
+        if (child.done) {
+            continue;
+        }
+        if (now >= child.deadline_ms) {
+            kill(-entry.first, child.terminated ? SIGKILL : SIGTERM);
+            if (!child.terminated) {
+                log_msg(LogLevel::WARN, "", 0, "", "", 0,
+                        "Helper process " + std::to_string(entry.first) +
+                        " timed out, sending SIGTERM");
+            }
+            child.timed_out = true;
+            child.terminated = true;
+            child.deadline_ms = now + CHILD_KILL_GRACE_MS;
+        }
+        int64_t wait = child.deadline_ms - now;
+        next = next < 0 ? wait : std::min(next, wait);
+    }
+    return static_cast<int>(next);
+}
+
+}
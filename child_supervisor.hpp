@@ -0,0 +1,101 @@
+#ifndef CHILD_SUPERVISOR_H
+#define CHILD_SUPERVISOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace ImageCurry {
+
+constexpr int CHILD_KILL_GRACE_MS = 2000;  // SIGTERM to SIGKILL for a hung child
+
+struct ChildResult {
+    bool started = false;       // false if fork() failed
+    bool timed_out = false;     // killed for running past its timeout
+    int status = 0;             // as reported by waitpid()
+    int error = 0;              // errno from a failed fork()
+
+    bool ok() const { return started && !timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0; }
+};
+
+struct ChildCounters {
+    uint64_t started;
+    uint64_t succeeded;
+    uint64_t failed;            // non-zero exit or killed by a signal
+    uint64_t timed_out;
+    uint64_t fork_failed;
+};
+
+// Runs helper programs (compressor.sh) for the encoder threads. A reaper
+// thread reads SIGCHLD from a signalfd and collects every exit with
+// waitpid(), so no child outlives its job as a zombie. A child still running
+// at its deadline gets SIGTERM, and SIGKILL CHILD_KILL_GRACE_MS later; both go
+// to its process group, so whatever it started dies with it.
+class ChildSupervisor {
+public:
+    static ChildSupervisor& get_instance();
+
+    // Blocks SIGCHLD for the calling thread. Call in main() before any thread
+    // starts so that all of them inherit the mask and the signal is only ever
+    // seen through the signalfd.
+    static bool block_sigchld();
+
+    bool start();
+    void stop();
+
+    // Forks, execs argv[0] with argv in dir, and blocks until the child exits or is killed after timeout seconds. argv is
+    // null-terminated and built before the call: the child only makes
+    // async-signal-safe calls. Without a running reaper it falls back to a
+    // plain waitpid() and no timeout. on_start, if given, is called with the
+    // child's pid (also its process group) once it has been forked.
+    ChildResult run(const char* const* argv, const char* dir, int timeout,
+                    const std::function<void(pid_t)>& on_start = nullptr);
+
+    // Adds a run to the counters; run() does so itself, this is for runs
+    // made on the supervisor's behalf elsewhere.
+    void record(const ChildResult& result);
+    ChildCounters counters() const;
+
+private:
+    ChildSupervisor() = default;
+    ChildSupervisor(const ChildSupervisor&) = delete;
+    ChildSupervisor& operator=(const ChildSupervisor&) = delete;
+    ~ChildSupervisor();
+
+    struct Child {
+        int64_t deadline_ms;
+        bool terminated = false;    // SIGTERM sent; deadline is now the SIGKILL
+        bool done = false;
+        bool timed_out = false;
+        int status = 0;
+    };
+
+    pid_t spawn(const char* const* argv, const char* dir);
+    void reaper_loop();
+    void reap();
+    int enforce_deadlines();
+
+    std::mutex mutex;
+    std::condition_variable exited;
+    std::unordered_map<pid_t, Child> children;
+    bool running = false;
+    bool stopping = false;
+    int signal_fd = -1;
+    int wake_fd = -1;
+    std::thread reaper;
+
+    std::atomic<uint64_t> started{0};
+    std::atomic<uint64_t> succeeded{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> timed_out{0};
+    std::atomic<uint64_t> fork_failed{0};
+};
+
+}
+#endif
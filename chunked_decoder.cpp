@@ -0,0 +1,156 @@
+#include "chunked_decoder.hpp"
+#include <algorithm>
+
+namespace ImageCurry {
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void ChunkedDecoder::fail(const char* error) {
+    state_ = State::FAILED;
+    error_ = error;
+}
+
+void ChunkedDecoder::start_size_line() {
+    state_ = State::SIZE;
+    size_digits_ = 0;
+    line_len_ = 0;
+}
+
+bool ChunkedDecoder::end_size_line() {
+    if (size_digits_ == 0) {
+        fail("Missing chunk size");
+        return false;
+    }
+
+    if (chunk_remaining_ > limit_ - total_) {
+        too_large_ = true;
+        fail("Chunked body too large");
+        return false;
+    }
+
+    state_ = (chunk_remaining_ == 0) ? State::TRAILER : State::DATA;
+    line_len_ = 0;
+    return true;
+}
+
+size_t ChunkedDecoder::decode(const char* data, size_t len, std::string_view& payload) {
+    payload = std::string_view();
+    size_t i = 0;
+
+    while (i < len) {
+        char c = data[i];
+
+        switch (state_) {
+        case State::SIZE: {
+            int digit = hex_value(c);
+            if (digit >= 0) {
+                if (chunk_remaining_ > (UINT64_MAX >> 4)) {
+                    too_large_ = true;
+                    fail("Chunk size overflow");
+                    return i;
+                }
+                chunk_remaining_ = (chunk_remaining_ << 4) | static_cast<uint64_t>(digit);
+                size_digits_++;
+                if (++line_len_ > MAX_CHUNK_LINE) {
+                    fail("Chunk size line too long");
+                    return i;
+                }
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                state_ = State::EXTENSION;
+                line_len_++;
+            } else if (c == '\r') {
+                state_ = State::SIZE_LF;
+            } else if (c == '\n') {
+                if (!end_size_line()) return i;
+            } else {
+                fail("Invalid chunk size");
+                return i;
+            }
+            i++;
+            break;
+        }
+
+        case State::EXTENSION:
+            if (c == '\n') {
+                if (!end_size_line()) return i;
+            } else if (++line_len_ > MAX_CHUNK_LINE) {
+                fail("Chunk extension too long");
+                return i;
+            }
+            i++;
+            break;
+
+        case State::SIZE_LF:
+            if (c != '\n') {
+                fail("Invalid chunk size line");
+                return i;
+            }
+            if (!end_size_line()) return i;
+            i++;
+            break;
+
+        case State::DATA: {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(chunk_remaining_, len - i));
+            payload = std::string_view(data + i, n);
+            chunk_remaining_ -= n;
+            total_ += n;
+            if (chunk_remaining_ == 0) {
+                state_ = State::DATA_CR;
+            }
+            // One payload span per call; the caller loops for the rest.
+            return i + n;
+        }
+
+        case State::DATA_CR:
+            if (c == '\r') {
+                state_ = State::DATA_LF;
+            } else if (c == '\n') {
+                start_size_line();
+            } else {
+                fail("Missing CRLF after chunk data");
+                return i;
+            }
+            i++;
+            break;
+
+        case State::DATA_LF:
+            if (c != '\n') {
+                fail("Missing CRLF after chunk data");
+                return i;
+            }
+            start_size_line();
+            i++;
+            break;
+
+        case State::TRAILER:
+            if (c == '\n') {
+                if (line_len_ == 0) {
+                    state_ = State::DONE;
+                    return i + 1;
+                }
+                line_len_ = 0;
+            } else if (c != '\r') {
+                line_len_++;
+            }
+            if (++trailer_len_ > MAX_TRAILER_SIZE) {
+                fail("Chunked trailer too large");
+                return i;
+            }
+            i++;
+            break;
+
+        case State::DONE:
+        case State::FAILED:
+            return i;
+        }
+    }
+
+    return i;
+}
+
+}
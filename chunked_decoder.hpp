@@ -0,0 +1,61 @@
+#ifndef CHUNKED_DECODER_H
+#define CHUNKED_DECODER_H
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageCurry {
+
+constexpr size_t MAX_CHUNK_LINE = 4096;        // chunk-size line incl. extensions
+constexpr size_t MAX_TRAILER_SIZE = 8192;
+
+// Streaming decoder for Transfer-Encoding: chunked (RFC 9112 7.1). Framing is
+// consumed as it arrives and never buffered; payload is handed back as views
+// into the caller's input so it can go straight to an UploadSink. Decoding
+// fails as soon as a chunk size would take the payload past limit, before
+// any of that chunk is received.
+class ChunkedDecoder {
+public:
+    explicit ChunkedDecoder(uint64_t limit) : limit_(limit) {}
+
+    // Consumes a prefix of data and returns its length. payload is set to the
+    // chunk data within that prefix, or left empty if there was none.
+    size_t decode(const char* data, size_t len, std::string_view& payload);
+
+    bool done() const { return state_ == State::DONE; }
+    bool failed() const { return state_ == State::FAILED; }
+    bool too_large() const { return too_large_; }
+    const char* error() const { return error_; }
+    uint64_t total() const { return total_; }
+
+private:
+    enum class State {
+        SIZE,           // hex digits of the chunk size
+        EXTENSION,      // ;name=value after the size, skipped
+        SIZE_LF,
+        DATA,
+        DATA_CR,        // CRLF closing the chunk data
+        DATA_LF,
+        TRAILER,        // trailer fields after the last chunk, skipped
+        DONE,
+        FAILED
+    };
+
+    void start_size_line();
+    bool end_size_line();
+    void fail(const char* error);
+
+    State state_ = State::SIZE;
+    uint64_t limit_;
+    uint64_t total_ = 0;
+    uint64_t chunk_remaining_ = 0;
+    size_t size_digits_ = 0;
+    size_t line_len_ = 0;
+    size_t trailer_len_ = 0;
+    bool too_large_ = false;
+    const char* error_ = "";
+};
+
+}
+#endif
@@ -0,0 +1,471 @@
+#include "compression.hpp"
+#include "compression_helper.hpp"
+#include "config.hpp"
+#include "image_codec.hpp"
+#include "job_journal.hpp"
+#include "logging.hpp"
+#include "object_cache.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace ImageCurry {
+
+// args are compressor.sh's arguments; input_path is only for messages.
+// Returns whether compressor.sh ran and exited with status 0.
+static bool run_compressor_script(const std::string& input_path,
+                                  const std::vector<std::string>& args) {
+    char exe_path[4096];
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len == -1) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to get executable path");
+        return false;
+    }
+    exe_path[len] = '\0';
+
+    char* last_slash = strrchr(exe_path, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+    }
+
+    std::string compressor_path = std::string(exe_path) + "/compressor.sh";
+
+    struct stat st;
+    if (stat(compressor_path.c_str(), &st) != 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "compressor.sh not found at " + compressor_path);
+        return false;
+    }
+
+    // The compression helper forks and execs this; see compression_helper.hpp.
+    std::vector<const char*> argv = {"/bin/bash", compressor_path.c_str()};
+    for (const std::string& arg : args) {
+        argv.push_back(arg.c_str());
+    }
+    argv.push_back(nullptr);
+
+    ChildResult result = CompressionHelper::get_instance().run(
+        argv.data(), exe_path, config().compress_timeout);
+    if (!result.started) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to run compressor.sh for " + input_path + ": " +
+                std::string(strerror(result.error)));
+    } else if (result.timed_out) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "compressor.sh timed out after " + std::to_string(config().compress_timeout) +
+                "s for " + input_path + " and was killed");
+    } else if (WIFSIGNALED(result.status)) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "compressor.sh killed by signal " + std::to_string(WTERMSIG(result.status)) +
+                " for " + input_path);
+    } else if (!result.ok()) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "compressor.sh failed for " + input_path + " (status " +
+                std::to_string(WEXITSTATUS(result.status)) + ")");
+    }
+    return result.ok();
+}
+
+// The --variants outputs come first and the default WebP last, so once
+// job.output_path exists every variant does too.
+static std::vector<WebpOutput> job_outputs(const CompressionJob& job) {
+    std::vector<WebpOutput> outputs;
+    for (const ImageVariant& variant : config().variants) {
+        outputs.push_back(WebpOutput{build_serve_path(variant_name(job.name, variant.width)),
+                                     variant.width, static_cast<float>(variant.quality)});
+    }
+    outputs.push_back(WebpOutput{job.output_path, WEBP_MAX_DIMENSION, WEBP_QUALITY});
+    return outputs;
+}
+
+// compressor.sh INPUT OUTPUT [WIDTH QUALITY VARIANT_OUTPUT]..., or
+// compressor.sh --resize INPUT OUTPUT WIDTH HEIGHT FIT QUALITY.
+static std::vector<std::string> script_args(const CompressionJob& job,
+                                            const std::vector<WebpOutput>& outputs) {
+    if (job.resize) {
+        const ResizeSpec& spec = *job.resize;
+        return {"--resize", job.input_path, job.output_path, std::to_string(spec.width),
+                std::to_string(spec.height), spec.fit == ResizeFit::COVER ? "cover" : "inside",
+                std::to_string(spec.quality)};
+    }
+
+    std::vector<std::string> args = {job.input_path, outputs.back().path};
+    for (size_t i = 0; i + 1 < outputs.size(); i++) {
+        args.push_back(std::to_string(outputs[i].max_dimension));
+        args.push_back(std::to_string(static_cast<int>(outputs[i].quality)));
+        args.push_back(outputs[i].path);
+    }
+    return args;
+}
+
+// A compressor.sh run that failed or was killed may have left a partly
+// written WebP behind, which must not be served.
+static bool run_script(const CompressionJob& job, const std::vector<WebpOutput>& outputs) {
+    if (run_compressor_script(job.input_path, script_args(job, outputs))) {
+        return true;
+    }
+    unlink(job.output_path.c_str());
+    for (const WebpOutput& output : outputs) {
+        unlink(output.path.c_str());
+    }
+    return false;
+}
+
+static bool encode(const CompressionJob& job) {
+    std::vector<WebpOutput> outputs;
+    if (!job.resize) {
+        outputs = job_outputs(job);
+    }
+    if (!use_native_encoder()) {
+        return run_script(job, outputs);
+    }
+
+    std::string error;
+    CodecResult result = job.resize
+        ? resize_to_webp(job.input_path, job.output_path, *job.resize, error)
+        : convert_to_webp(job.input_path, outputs, error);
+    if (result == CodecResult::UNSUPPORTED) {
+        return run_script(job, outputs);
+    } else if (result == CodecResult::FAILED) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "WebP encode failed for " + job.input_path + ": " + error);
+        return false;
+    }
+    return true;
+}
+
+static bool run_job(const CompressionJob& job) {
+    bool ok = encode(job);
+
+    // Outputs appear complete, by rename, but drop anything cached under their
+    // names anyway: the cache must never outlive the files it mirrors.
+    ObjectCache& cache = ObjectCache::get_instance();
+    if (job.resize) {
+        cache.invalidate(DERIVED_CACHE_PREFIX + job.name);
+        return ok;
+    }
+    for (const ImageVariant& variant : config().variants) {
+        cache.invalidate(variant_name(job.name, variant.width));
+    }
+    cache.invalidate(job.name);
+    return ok;
+}
+
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t deadline_for(const CompressionJob& job) {
+    int64_t mb = static_cast<int64_t>(job.input_size / (1024 * 1024));
+    int64_t delay = std::min(mb * PRIORITY_MS_PER_MB, PRIORITY_MAX_SIZE_DELAY_MS);
+    if (job.priority == JobPriority::BULK) {
+        delay += PRIORITY_BULK_DELAY_MS;
+    }
+    return now_ms() + delay;
+}
+
+static std::string file_name(const std::string& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+CompressionPool& CompressionPool::get_instance() {
+    static CompressionPool instance;
+    return instance;
+}
+
+CompressionPool::~CompressionPool() {
+    stop();
+}
+
+void CompressionPool::start(int worker_count, size_t queue_capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = queue_capacity;
+    stopping = false;
+    for (int i = 0; i < worker_count; i++) {
+        workers.emplace_back(&CompressionPool::worker_loop, this);
+    }
+}
+
+void CompressionPool::stop() {
+    size_t abandoned = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (workers.empty()) {
+            return;
+        }
+        stopping = true;
+        abandoned = queue.size();
+        queue.clear();
+    }
+    not_empty.notify_all();
+    not_full.notify_all();
+
+    for (auto& t : workers) {
+        t.join();
+    }
+    workers.clear();
+
+    if (abandoned > 0) {
+        log_msg(LogLevel::WARN, "", 0, "", "", 0,
+                "Shutdown abandoned " + std::to_string(abandoned) + " queued compression job(s)");
+    }
+}
+
+bool CompressionPool::reserve(bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait) {
+        not_full.wait(lock, [this] { return stopping || queue.size() + reserved < capacity; });
+    }
+    if (stopping || queue.size() + reserved >= capacity) {
+        return false;
+    }
+    reserved++;
+    return true;
+}
+
+void CompressionPool::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reserved--;
+    }
+    not_full.notify_one();
+}
+
+// A name already pending (a recovered job uploaded again, say) is queued
+// or running already, so the slot is simply given back.
+void CompressionPool::submit(CompressionJob job) {
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reserved--;
+        if (stopping) {
+            return;
+        }
+        if (pending.count(job.name) == 0) {
+            pending[job.name].input_path = job.input_path;
+            JobJournal::get_instance().enqueued(job);
+            int64_t deadline = deadline_for(job);
+            push(std::move(job), deadline);
+            queued = true;
+        }
+    }
+    if (queued) {
+        not_empty.notify_one();
+    } else {
+        not_full.notify_one();
+    }
+}
+
+// Called with the lock held, after the job's pending entry exists.
+void CompressionPool::push(CompressionJob job, int64_t deadline) {
+    std::string name = job.name;
+    pending[name].queued = queue.emplace(deadline, std::move(job));
+}
+
+// Called with the lock held. Equal deadlines keep their queue order, so a
+// boosted job runs after others boosted or requested before it.
+void CompressionPool::boost(PendingJob& job) {
+    int64_t now = now_ms();
+    if (job.queued == queue.end() || job.queued->first <= now) {
+        return;
+    }
+    auto node = queue.extract(job.queued);
+    node.key() = now;
+    job.queued = queue.insert(std::move(node));
+}
+
+bool CompressionPool::request(const std::string& name, std::shared_ptr<WaitTicket> ticket) {
+    return enqueue(CompressionJob{"", build_serve_path(name), name, name, std::nullopt},
+                   std::move(ticket));
+}
+
+bool CompressionPool::request_resize(const std::string& name, const std::string& source,
+                                     const ResizeSpec& spec,
+                                     std::shared_ptr<WaitTicket> ticket) {
+    return enqueue(CompressionJob{"", build_derived_path(name), name, source, spec},
+                   std::move(ticket));
+}
+
+bool CompressionPool::enqueue(CompressionJob job, std::shared_ptr<WaitTicket> ticket) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pending.find(job.name);
+        if (it != pending.end()) {
+            it->second.waiters.push_back(std::move(ticket));
+            boost(it->second);
+            return true;
+        }
+        if (stopping || queue.size() + reserved >= capacity) {
+            return false;
+        }
+        pending[job.name].waiters.push_back(std::move(ticket));
+        push(std::move(job), now_ms());
+    }
+    not_empty.notify_one();
+    return true;
+}
+
+bool CompressionPool::wait(const std::string& name, std::shared_ptr<WaitTicket> ticket) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(name);
+    if (it == pending.end()) {
+        return false;
+    }
+    it->second.waiters.push_back(std::move(ticket));
+    boost(it->second);
+    return true;
+}
+
+std::string CompressionPool::pending_original(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(name);
+    if (it == pending.end()) {
+        return "";
+    }
+    boost(it->second);
+    return it->second.input_path;
+}
+
+void CompressionPool::locate_input(CompressionJob& job) {
+    job.input_path = find_original(job.source);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = pending.find(job.name);
+    if (it != pending.end()) {
+        it->second.input_path = job.input_path;
+    }
+}
+
+void CompressionPool::finish(const std::string& name) {
+    std::vector<std::shared_ptr<WaitTicket>> done;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = pending.find(name);
+        if (it == pending.end()) {
+            return;
+        }
+        done.swap(it->second.waiters);
+        pending.erase(it);
+    }
+    for (auto& ticket : done) {
+        ticket->notifier->post(ticket);
+    }
+}
+
+void CompressionPool::worker_loop() {
+    while (true) {
+        CompressionJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            auto next = queue.begin();
+            job = std::move(next->second);
+            queue.erase(next);
+            pending[job.name].queued = queue.end();
+        }
+        not_full.notify_one();
+
+        // Jobs queued with their input are the eager ones; on-demand jobs
+        // are requested again by clients, so only eager jobs are journaled.
+        bool journaled = !job.input_path.empty();
+        if (journaled) {
+            JobJournal::get_instance().started(job.name);
+        }
+
+        if (job.input_path.empty()) {
+            locate_input(job);
+        }
+        bool ok = false;
+        if (job.input_path.empty()) {
+            log_msg(LogLevel::WARN, "", 0, "", "", 0,
+                    "No original found to encode " + job.name);
+        } else {
+            ok = run_job(job);
+        }
+
+        if (journaled) {
+            JobJournal::get_instance().finished(
+                job.name, ok && access(job.output_path.c_str(), F_OK) == 0);
+        }
+        finish(job.name);
+    }
+}
+
+CompressionSlot::~CompressionSlot() {
+    if (held_) {
+        CompressionPool::get_instance().release();
+    }
+}
+
+CompressionSlot& CompressionSlot::operator=(CompressionSlot&& other) noexcept {
+    if (this != &other) {
+        if (held_) {
+            CompressionPool::get_instance().release();
+        }
+        held_ = other.held_;
+        other.held_ = false;
+    }
+    return *this;
+}
+
+CompressionSlot CompressionSlot::acquire() {
+    CompressionSlot slot;
+    bool wait = config().compress_overflow == OverflowPolicy::WAIT;
+    slot.held_ = CompressionPool::get_instance().reserve(wait);
+    return slot;
+}
+
+void CompressionSlot::submit(const std::string& input_path, const std::string& output_path,
+                             JobPriority priority, size_t input_size) {
+    if (!held_) {
+        return;
+    }
+    held_ = false;
+    std::string name = file_name(output_path);
+    CompressionPool::get_instance().submit(
+        CompressionJob{input_path, output_path, name, name, std::nullopt, priority, input_size});
+}
+
+void compression_start() {
+    int workers = config().compress_workers;
+    if (workers <= 0) {
+        workers = static_cast<int>(std::thread::hardware_concurrency());
+        if (workers <= 0) workers = 1;
+    }
+
+    ChildSupervisor::get_instance().start();
+    CompressionHelper::get_instance().start();
+    CompressionPool::get_instance().start(workers, config().compress_queue);
+    log_msg(LogLevel::INFO, "", 0, "", "", 0,
+            "Compression pool started with " + std::to_string(workers) +
+            " worker(s), queue capacity " + std::to_string(config().compress_queue));
+}
+
+void compression_stop() {
+    CompressionPool::get_instance().stop();
+    CompressionHelper::get_instance().stop();
+    ChildSupervisor::get_instance().stop();
+
+    ChildCounters counters = ChildSupervisor::get_instance().counters();
+    if (counters.started + counters.fork_failed > 0) {
+        log_msg(LogLevel::INFO, "", 0, "", "", 0,
+                "compressor.sh runs: " + std::to_string(counters.started) + " started, " +
+                std::to_string(counters.succeeded) + " succeeded, " +
+                std::to_string(counters.failed) + " failed, " +
+                std::to_string(counters.timed_out) + " timed out, " +
+                std::to_string(counters.fork_failed) + " fork failures");
+    }
+}
+
+}
@@ -0,0 +1,132 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "image_codec.hpp"
+#include "loop_notifier.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace ImageCurry {
+
+// Jobs run in order of a deadline: the time they were queued plus a delay
+// that grows with their input size and is larger still for bulk jobs. Every
+// job therefore ages towards the front, and a bulk job is passed by newer
+// interactive ones for at most PRIORITY_BULK_DELAY_MS. A job someone has
+// requested through /retrieve, and every on-demand job, is due at once.
+constexpr int64_t PRIORITY_BULK_DELAY_MS = 60 * 1000;
+constexpr int64_t PRIORITY_MS_PER_MB = 100;
+constexpr int64_t PRIORITY_MAX_SIZE_DELAY_MS = 10 * 1000;
+
+enum class JobPriority {
+    INTERACTIVE,
+    BULK            // backfills: POST /upload?priority=bulk, recovered jobs
+};
+
+struct CompressionJob {
+    std::string input_path;     // empty for on-demand jobs: found when run
+    std::string output_path;
+    std::string name;           // output file name, the key for waiters
+    std::string source;         // the WebP whose original is the input
+    std::optional<ResizeSpec> resize;   // set for on-the-fly resizes
+    JobPriority priority = JobPriority::INTERACTIVE;
+    size_t input_size = 0;
+};
+
+// Fixed set of encoder threads fed by a bounded priority queue. Producers
+// reserve a slot before committing to an upload so a full queue can be
+// reported to the client (or waited on) before anything is written to disk.
+class CompressionPool {
+public:
+    static CompressionPool& get_instance();
+    void start(int workers, size_t capacity);
+    void stop();
+
+    bool reserve(bool wait);
+    void release();
+    void submit(CompressionJob job);
+
+    // Every queued or running job is tracked by output name until it
+    // finishes, successfully or not, at which point its waiters' tickets are
+    // posted.
+    //
+    // request(): on-demand encode of SERVE_DIR/name from its original
+    // (--compress-mode=lazy), joining a pending job if there is one. Returns
+    // false if a new job would overflow the queue.
+    // request_resize(): the same for DERIVED_DIR/name, resized to spec from
+    // the original of the WebP source.
+    // wait(): joins a pending job only; false if none is pending.
+    // pending_original(): the input of a pending job, or "" if there is no
+    // job or its input has not been located yet.
+    // All three move a job that is still queued to the front.
+    bool request(const std::string& name, std::shared_ptr<WaitTicket> ticket);
+    bool request_resize(const std::string& name, const std::string& source,
+                        const ResizeSpec& spec, std::shared_ptr<WaitTicket> ticket);
+    bool wait(const std::string& name, std::shared_ptr<WaitTicket> ticket);
+    std::string pending_original(const std::string& name);
+
+private:
+    CompressionPool() = default;
+    CompressionPool(const CompressionPool&) = delete;
+    CompressionPool& operator=(const CompressionPool&) = delete;
+    ~CompressionPool();
+
+    using JobQueue = std::multimap<int64_t, CompressionJob>;   // by deadline
+
+    struct PendingJob {
+        std::string input_path;
+        std::vector<std::shared_ptr<WaitTicket>> waiters;
+        JobQueue::iterator queued;      // queue.end() once a worker has it
+    };
+
+    bool enqueue(CompressionJob job, std::shared_ptr<WaitTicket> ticket);
+    void push(CompressionJob job, int64_t deadline);
+    void boost(PendingJob& job);
+    void worker_loop();
+    void locate_input(CompressionJob& job);
+    void finish(const std::string& name);
+
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    JobQueue queue;
+    std::unordered_map<std::string, PendingJob> pending;
+    std::vector<std::thread> workers;
+    size_t capacity = 0;
+    size_t reserved = 0;
+    bool stopping = false;
+};
+
+// A queue slot held while an upload is being stored. Submitting consumes the
+// slot; destroying an unsubmitted slot hands it back to the pool.
+class CompressionSlot {
+public:
+    CompressionSlot() = default;
+    ~CompressionSlot();
+
+    CompressionSlot(const CompressionSlot&) = delete;
+    CompressionSlot& operator=(const CompressionSlot&) = delete;
+    CompressionSlot(CompressionSlot&& other) noexcept : held_(other.held_) { other.held_ = false; }
+    CompressionSlot& operator=(CompressionSlot&& other) noexcept;
+
+    static CompressionSlot acquire();
+    explicit operator bool() const { return held_; }
+    void submit(const std::string& input_path, const std::string& output_path,
+                JobPriority priority, size_t input_size);
+
+private:
+    bool held_ = false;
+};
+
+void compression_start();
+void compression_stop();
+
+}
+#endif
@@ -0,0 +1,346 @@
+#include "compression_helper.hpp"
+#include "logging.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+namespace ImageCurry {
+
+// Request: the header, then NUL-terminated strings: the working directory
+// followed by argv. Replies: a start notice carrying the child's pid, then
+// the result, both HelperReply with the same id.
+struct HelperRequest {
+    uint64_t id;
+    int32_t timeout;
+};
+
+struct HelperReply {
+    uint64_t id;
+    int32_t pid;            // set only in the start notice
+    int32_t started;
+    int32_t timed_out;
+    int32_t status;
+    int32_t error;
+};
+
+CompressionHelper& CompressionHelper::get_instance() {
+    static CompressionHelper instance;
+    return instance;
+}
+
+CompressionHelper::~CompressionHelper() {
+    stop();
+}
+
+bool CompressionHelper::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = false;
+    if (!spawn()) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Compression helper not started, forking compressor.sh from the server");
+        return false;
+    }
+    running = true;
+    reader = std::thread(&CompressionHelper::reader_loop, this);
+    return true;
+}
+
+// Closing our end makes the helper finish and exit. No run is in flight:
+// the encoder threads are stopped first.
+void CompressionHelper::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        stopping = true;
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+    reader.join();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+    close(socket_fd);
+    socket_fd = -1;
+    if (helper_pid > 0) {
+        while (waitpid(helper_pid, nullptr, 0) < 0 && errno == EINTR) {}
+        helper_pid = -1;
+    }
+}
+
+// Called with the lock held.
+bool CompressionHelper::spawn() {
+    char exe_path[4096];
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len == -1) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to get executable path for the compression helper");
+        return false;
+    }
+    exe_path[len] = '\0';
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to create compression helper socket: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    // dup2() onto itself would leave close-on-exec set.
+    int child_end = fds[1];
+    if (child_end == HELPER_FD) {
+        child_end = fcntl(fds[1], F_DUPFD_CLOEXEC, HELPER_FD + 1);
+        close(fds[1]);
+    }
+
+    // The server blocks SIGCHLD and ignores SIGPIPE; the helper starts clean.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, child_end, HELPER_FD);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    char* argv[] = {exe_path, const_cast<char*>(COMPRESSION_HELPER_ARG), nullptr};
+    pid_t pid;
+    int rc = posix_spawn(&pid, exe_path, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(child_end);
+
+    if (rc != 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to start compression helper: " + std::string(strerror(rc)));
+        close(fds[0]);
+        return false;
+    }
+
+    socket_fd = fds[0];
+    helper_pid = pid;
+    log_msg(LogLevel::INFO, "", 0, "", "", 0,
+            "Compression helper started as process " + std::to_string(pid));
+    return true;
+}
+
+// Called with the lock held.
+void CompressionHelper::fail(Call& call, int error) {
+    call.done = true;
+    call.result = ChildResult{};
+    call.result.error = error;
+}
+
+// Called by the reader, with the lock held, once the helper's end is closed.
+// The helper's children die with it (PR_SET_PDEATHSIG), but what they
+// started would keep writing the same temporary output as the resent run,
+// so each started run's process group is killed first.
+void CompressionHelper::restart() {
+    int status = 0;
+    while (waitpid(helper_pid, &status, 0) < 0 && errno == EINTR) {}
+    log_msg(LogLevel::WARN, "", 0, "", "", 0,
+            "Compression helper exited (" +
+            (WIFSIGNALED(status) ? "signal " + std::to_string(WTERMSIG(status))
+                                 : "status " + std::to_string(WEXITSTATUS(status))) +
+            "), restarting it");
+    close(socket_fd);
+    socket_fd = -1;
+    helper_pid = -1;
+
+    for (auto& entry : calls) {
+        Call& call = entry.second;
+        if (!call.done && call.pgid > 0) {
+            kill(-call.pgid, SIGKILL);
+            call.pgid = -1;
+        }
+    }
+
+    if (!spawn()) {
+        running = false;
+        for (auto& entry : calls) {
+            if (!entry.second.done) {
+                fail(entry.second, EPIPE);
+            }
+        }
+        return;
+    }
+
+    for (auto& entry : calls) {
+        Call& call = entry.second;
+        if (call.done) {
+            continue;
+        }
+        if (++call.attempts > HELPER_MAX_ATTEMPTS) {
+            fail(call, EPIPE);
+        } else {
+            send(socket_fd, call.request.data(), call.request.size(), MSG_NOSIGNAL);
+        }
+    }
+}
+
+ChildResult CompressionHelper::run(const char* const* argv, const char* dir, int timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!running) {
+        lock.unlock();
+        return ChildSupervisor::get_instance().run(argv, dir, timeout);
+    }
+
+    uint64_t id = next_id++;
+    HelperRequest header{id, timeout};
+    std::string request(reinterpret_cast<const char*>(&header), sizeof(header));
+    request.append(dir).push_back('\0');
+    for (const char* const* arg = argv; *arg; arg++) {
+        request.append(*arg).push_back('\0');
+    }
+
+    Call& call = calls[id];
+    if (request.size() > HELPER_MAX_MESSAGE) {
+        fail(call, E2BIG);
+    } else {
+        // A failed send means the helper is gone; the reader restarts it and
+        // sends the request again.
+        call.request = std::move(request);
+        send(socket_fd, call.request.data(), call.request.size(), MSG_NOSIGNAL);
+    }
+
+    replied.wait(lock, [&] { return calls.at(id).done; });
+    ChildResult result = calls.at(id).result;
+    calls.erase(id);
+    lock.unlock();
+
+    ChildSupervisor::get_instance().record(result);
+    return result;
+}
+
+void CompressionHelper::reader_loop() {
+    while (true) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fd = socket_fd;
+        }
+
+        HelperReply reply;
+        ssize_t n = recv(fd, &reply, sizeof(reply), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (n == static_cast<ssize_t>(sizeof(reply))) {
+            auto it = calls.find(reply.id);
+            if (it != calls.end() && reply.pid > 0) {
+                it->second.pgid = reply.pid;
+            } else if (it != calls.end()) {
+                it->second.done = true;
+                it->second.result.started = reply.started != 0;
+                it->second.result.timed_out = reply.timed_out != 0;
+                it->second.result.status = reply.status;
+                it->second.result.error = reply.error;
+                replied.notify_all();
+            }
+            continue;
+        }
+
+        if (stopping) {
+            return;
+        }
+        restart();
+        replied.notify_all();
+        if (!running) {
+            return;
+        }
+    }
+}
+
+int compression_helper_main() {
+    // Ctrl+C reaches the whole process group; the helper finishes its runs
+    // and exits when the server closes the socket.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    // Inherited without close-on-exec; compressor.sh must not hold it open,
+    // or the server would not see the helper exit while a run is in flight.
+    fcntl(HELPER_FD, F_SETFD, FD_CLOEXEC);
+    ChildSupervisor::block_sigchld();
+    ChildSupervisor& supervisor = ChildSupervisor::get_instance();
+    supervisor.start();
+
+    std::mutex mutex;                   // guards sends and active
+    std::condition_variable idle;
+    size_t active = 0;
+
+    std::vector<char> buffer(HELPER_MAX_MESSAGE);
+    while (true) {
+        ssize_t n = recv(HELPER_FD, buffer.data(), buffer.size(), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        HelperRequest header;
+        std::vector<std::string> strings;
+        bool valid = static_cast<size_t>(n) > sizeof(header) && buffer[n - 1] == '\0';
+        if (valid) {
+            memcpy(&header, buffer.data(), sizeof(header));
+            for (size_t at = sizeof(header); at < static_cast<size_t>(n);) {
+                strings.emplace_back(buffer.data() + at);
+                at += strings.back().size() + 1;
+            }
+            valid = strings.size() >= 2;
+        }
+        if (!valid) {
+            continue;           // the server never sends these
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        active++;
+        std::thread([&, header, strings = std::move(strings)] {
+            std::vector<const char*> argv;
+            for (size_t i = 1; i < strings.size(); i++) {
+                argv.push_back(strings[i].c_str());
+            }
+            argv.push_back(nullptr);
+
+            auto notify = [&](pid_t pid) {
+                HelperReply notice{header.id, pid, 0, 0, 0, 0};
+                std::lock_guard<std::mutex> lock(mutex);
+                send(HELPER_FD, &notice, sizeof(notice), MSG_NOSIGNAL);
+            };
+            ChildResult result = supervisor.run(argv.data(), strings[0].c_str(),
+                                                header.timeout, notify);
+            HelperReply reply{header.id, 0, result.started, result.timed_out,
+                              result.status, result.error};
+
+            std::lock_guard<std::mutex> lock(mutex);
+            send(HELPER_FD, &reply, sizeof(reply), MSG_NOSIGNAL);
+            if (--active == 0) {
+                idle.notify_all();
+            }
+        }).detach();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return active == 0; });
+    }
+    supervisor.stop();
+    return 0;
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef COMPRESSION_HELPER_H
+#define COMPRESSION_HELPER_H
+
+#include "child_supervisor.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <sys/types.h>
+
+namespace ImageCurry {
+
+constexpr const char* COMPRESSION_HELPER_ARG = "--compression-helper";
+constexpr int HELPER_FD = 3;                    // the helper's end of the socket
+constexpr size_t HELPER_MAX_MESSAGE = 64 * 1024;
+constexpr int HELPER_MAX_ATTEMPTS = 2;          // sends of one run across restarts
+
+// Launches compressor.sh from a small helper process instead of forking the
+// server, whose page tables (upload buffers, the object cache) fork() would
+// have to copy for every job. The helper is this binary re-executed with
+// COMPRESSION_HELPER_ARG through posix_spawn(), which does not copy the
+// server's address space either. Runs are sent over a SOCK_SEQPACKET socket
+// pair, one message per request and per reply, and the helper starts each
+// with its own ChildSupervisor, so timeouts and reaping work as before.
+//
+// Only compressor.sh runs go through the helper; the native encoder still
+// decodes and encodes in the server's threads, outside this isolation.
+//
+// If the helper dies, the process groups of the runs it had started are
+// killed, it is restarted, and those runs are sent again.
+// If it cannot be started, runs are forked from the server as before.
+class CompressionHelper {
+public:
+    static CompressionHelper& get_instance();
+
+    bool start();
+    void stop();
+
+    // Same contract as ChildSupervisor::run().
+    ChildResult run(const char* const* argv, const char* dir, int timeout);
+
+private:
+    CompressionHelper() = default;
+    CompressionHelper(const CompressionHelper&) = delete;
+    CompressionHelper& operator=(const CompressionHelper&) = delete;
+    ~CompressionHelper();
+
+    struct Call {
+        std::string request;
+        int attempts = 1;
+        pid_t pgid = -1;            // from the helper's start notice
+        bool done = false;
+        ChildResult result;
+    };
+
+    bool spawn();
+    void restart();
+    void fail(Call& call, int error);
+    void reader_loop();
+
+    std::mutex mutex;
+    std::condition_variable replied;
+    std::unordered_map<uint64_t, Call> calls;
+    uint64_t next_id = 1;
+    int socket_fd = -1;
+    pid_t helper_pid = -1;
+    bool running = false;
+    bool stopping = false;
+    std::thread reader;
+};
+
+// Entry point of the helper process: serves runs from HELPER_FD until the
+// server closes its end, then waits for the runs in progress and returns.
+int compression_helper_main();
+
+}
+#endif
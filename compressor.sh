@@ -1,2 +1,66 @@
 #!/bin/bash
-convert "$1" -resize "900x900>" -quality 65 -define webp:method=6 -strip "$2"
\ No newline at end of file
+# compressor.sh INPUT OUTPUT [WIDTH QUALITY VARIANT_OUTPUT]...
+# The input is decoded once; each variant is written from a clone of it
+# before the default 900x900 WebP.
+#
+# compressor.sh --resize INPUT OUTPUT WIDTH HEIGHT FIT QUALITY
+# One on-the-fly resize; 0 leaves a side unbounded, FIT is inside or cover.
+#
+# Every file is written under a temporary name and renamed into place, the
+# default WebP last, so a file the server can open is always complete.
+if [ "$1" = "--resize" ]; then
+    input="$2"
+    output="$3"
+    width="$4"
+    height="$5"
+    [ "$width" = "0" ] && width=""
+    [ "$height" = "0" ] && height=""
+
+    # cover trims the longer side around the centre to the box's aspect, then
+    # shrinks like inside, never enlarging: the same arithmetic as the native
+    # encoder, so a source smaller than the box (100x50 for 200x200) still
+    # comes out at the box's aspect (50x50).
+    geometry=( -resize "${width}x${height}>" )
+    if [ "$6" = "cover" ] && [ -n "$width" ] && [ -n "$height" ]; then
+        size=$(identify -ping -format "%w %h" "$input[0]") || exit 1
+        read -r src_w src_h <<< "$size"
+        crop_w=$src_w
+        crop_h=$src_h
+        if (( src_w * height > src_h * width )); then
+            crop_w=$(( src_h * width / height ))
+            (( crop_w < 1 )) && crop_w=1
+        else
+            crop_h=$(( src_w * height / width ))
+            (( crop_h < 1 )) && crop_h=1
+        fi
+        geometry=( -crop "${crop_w}x${crop_h}+$(( (src_w - crop_w) / 2 ))+$(( (src_h - crop_h) / 2 ))"
+                   +repage "${geometry[@]}" )
+    fi
+
+    convert "$input" -strip -define webp:method=6 "${geometry[@]}" -quality "$7" "webp:$output.tmp" ||
+        { rm -f "$output.tmp"; exit 1; }
+    mv "$output.tmp" "$output"
+    exit
+fi
+
+input="$1"
+output="$2"
+shift 2
+
+variants=()
+written=()
+while [ $# -ge 3 ]; do
+    variants+=( "(" +clone -resize "$1x$1>" -quality "$2" -write "webp:$3.tmp" +delete ")" )
+    written+=( "$3" )
+    shift 3
+done
+
+if ! convert "$input" -strip -define webp:method=6 "${variants[@]}" \
+        -resize "900x900>" -quality 65 "webp:$output.tmp"; then
+    rm -f "$output.tmp" "${written[@]/%/.tmp}"
+    exit 1
+fi
+
+for path in "${written[@]}" "$output"; do
+    mv "$path.tmp" "$path" || exit 1
+done
@@ -0,0 +1,328 @@
+#include "config.hpp"
+#include "image_codec.hpp"
+#include "uring_loop.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+
+namespace ImageCurry {
+
+static ServerConfig server_config;
+
+const ServerConfig& config() {
+    return server_config;
+}
+
+bool use_native_encoder() {
+    return server_config.encoder != EncoderMode::SCRIPT && native_encoder_available();
+}
+
+static bool parse_int(const std::string& value, int min, int max, int& out) {
+    if (value.empty()) return false;
+
+    char* end = nullptr;
+    errno = 0;
+    long parsed = strtol(value.c_str(), &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed < min || parsed > max) {
+        return false;
+    }
+
+    out = static_cast<int>(parsed);
+    return true;
+}
+
+// "320,640:70,1600": widths with an optional quality, default WEBP_QUALITY.
+static bool parse_variants(const std::string& value, std::vector<ImageVariant>& out) {
+    out.clear();
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(',', start);
+        if (end == std::string::npos) end = value.size();
+        std::string item = value.substr(start, end - start);
+        start = end + 1;
+
+        ImageVariant variant{0, static_cast<int>(WEBP_QUALITY)};
+        size_t colon = item.find(':');
+        if (!parse_int(item.substr(0, colon), 16, 8192, variant.width)) {
+            return false;
+        }
+        if (colon != std::string::npos &&
+            !parse_int(item.substr(colon + 1), 1, 100, variant.quality)) {
+            return false;
+        }
+        out.push_back(variant);
+    }
+
+    std::sort(out.begin(), out.end(), [](const ImageVariant& a, const ImageVariant& b) {
+        return a.width < b.width;
+    });
+    auto same_width = [](const ImageVariant& a, const ImageVariant& b) {
+        return a.width == b.width;
+    };
+    return out.size() <= MAX_VARIANTS &&
+           std::adjacent_find(out.begin(), out.end(), same_width) == out.end();
+}
+
+static bool parse_int_list(const std::string& value, int min, int max, std::vector<int>& out) {
+    out.clear();
+    size_t start = 0;
+    while (start <= value.size()) {
+        size_t end = value.find(',', start);
+        if (end == std::string::npos) end = value.size();
+        int parsed = 0;
+        if (!parse_int(value.substr(start, end - start), min, max, parsed)) {
+            return false;
+        }
+        out.push_back(parsed);
+        start = end + 1;
+    }
+
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out.size() <= MAX_RESIZE_VALUES;
+}
+
+bool load_config(int argc, char** argv, std::string& error) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string name = arg;
+        std::string value;
+
+        auto eq = arg.find('=');
+        if (eq != std::string::npos) {
+            name = arg.substr(0, eq);
+            value = arg.substr(eq + 1);
+        }
+
+        if (name == "--workers") {
+            if (!parse_int(value, 0, 1024, server_config.workers)) {
+                error = "Invalid value for --workers: " + value;
+                return false;
+            }
+        } else if (name == "--pin-cpus") {
+            if (eq != std::string::npos) {
+                error = "--pin-cpus takes no value: " + arg;
+                return false;
+            }
+            server_config.pin_cpus = true;
+        } else if (name == "--engine") {
+            if (value == "epoll") {
+                server_config.engine = EngineMode::EPOLL;
+            } else if (value == "io_uring") {
+                if (!io_uring_available()) {
+                    error = "--engine=io_uring requires a build with io_uring headers";
+                    return false;
+                }
+                server_config.engine = EngineMode::IO_URING;
+            } else {
+                error = "Invalid value for --engine: " + value;
+                return false;
+            }
+        } else if (name == "--keepalive-timeout") {
+            if (!parse_int(value, 0, 3600, server_config.keepalive_timeout)) {
+                error = "Invalid value for --keepalive-timeout: " + value;
+                return false;
+            }
+        } else if (name == "--keepalive-requests") {
+            if (!parse_int(value, 1, 1000000, server_config.keepalive_requests)) {
+                error = "Invalid value for --keepalive-requests: " + value;
+                return false;
+            }
+        } else if (name == "--encoder") {
+            if (value == "auto") {
+                server_config.encoder = EncoderMode::AUTO;
+            } else if (value == "native") {
+                if (!native_encoder_available()) {
+                    error = "--encoder=native requires a build with libwebp";
+                    return false;
+                }
+                server_config.encoder = EncoderMode::NATIVE;
+            } else if (value == "script") {
+                server_config.encoder = EncoderMode::SCRIPT;
+            } else {
+                error = "Invalid value for --encoder: " + value;
+                return false;
+            }
+        } else if (name == "--compress-workers") {
+            if (!parse_int(value, 0, 1024, server_config.compress_workers)) {
+                error = "Invalid value for --compress-workers: " + value;
+                return false;
+            }
+        } else if (name == "--compress-queue") {
+            if (!parse_int(value, 1, 1000000, server_config.compress_queue)) {
+                error = "Invalid value for --compress-queue: " + value;
+                return false;
+            }
+        } else if (name == "--compress-overflow") {
+            if (value == "reject") {
+                server_config.compress_overflow = OverflowPolicy::REJECT;
+            } else if (value == "wait") {
+                server_config.compress_overflow = OverflowPolicy::WAIT;
+            } else {
+                error = "Invalid value for --compress-overflow: " + value;
+                return false;
+            }
+        } else if (name == "--compress-mode") {
+            if (value == "eager") {
+                server_config.compress_mode = CompressMode::EAGER;
+            } else if (value == "lazy") {
+                server_config.compress_mode = CompressMode::LAZY;
+            } else {
+                error = "Invalid value for --compress-mode: " + value;
+                return false;
+            }
+        } else if (name == "--compress-timeout") {
+            if (!parse_int(value, 1, 3600, server_config.compress_timeout)) {
+                error = "Invalid value for --compress-timeout: " + value;
+                return false;
+            }
+        } else if (name == "--pending") {
+            if (value == "original") {
+                server_config.pending = PendingPolicy::ORIGINAL;
+            } else if (value == "wait") {
+                server_config.pending = PendingPolicy::WAIT;
+            } else if (value == "404") {
+                server_config.pending = PendingPolicy::NOT_FOUND;
+            } else {
+                error = "Invalid value for --pending: " + value;
+                return false;
+            }
+        } else if (name == "--pending-timeout") {
+            if (!parse_int(value, 1, 300, server_config.pending_timeout)) {
+                error = "Invalid value for --pending-timeout: " + value;
+                return false;
+            }
+        } else if (name == "--variants") {
+            if (!parse_variants(value, server_config.variants)) {
+                error = "Invalid value for --variants: " + value;
+                return false;
+            }
+        } else if (name == "--resize-sizes") {
+            if (!parse_int_list(value, 1, 8192, server_config.resize_sizes)) {
+                error = "Invalid value for --resize-sizes: " + value;
+                return false;
+            }
+        } else if (name == "--resize-qualities") {
+            if (!parse_int_list(value, 1, 100, server_config.resize_qualities)) {
+                error = "Invalid value for --resize-qualities: " + value;
+                return false;
+            }
+        } else if (name == "--journal-sync-ms") {
+            if (!parse_int(value, 1, 10000, server_config.journal_sync_ms)) {
+                error = "Invalid value for --journal-sync-ms: " + value;
+                return false;
+            }
+        } else if (name == "--cache-size") {
+            if (!parse_int(value, 0, 1024 * 1024, server_config.cache_size_mb)) {
+                error = "Invalid value for --cache-size: " + value;
+                return false;
+            }
+        } else if (name == "--log-flush-ms") {
+            if (!parse_int(value, 1, 60000, server_config.log_flush_ms)) {
+                error = "Invalid value for --log-flush-ms: " + value;
+                return false;
+            }
+        } else if (name == "--log-overflow") {
+            if (value == "drop") {
+                server_config.log_overflow = LogOverflow::DROP;
+            } else if (value == "block") {
+                server_config.log_overflow = LogOverflow::BLOCK;
+            } else {
+                error = "Invalid value for --log-overflow: " + value;
+                return false;
+            }
+        } else if (name == "--upload-splice") {
+            if (eq != std::string::npos) {
+                error = "--upload-splice takes no value: " + arg;
+                return false;
+            }
+            server_config.upload_splice = true;
+        } else if (name == "--dedup") {
+            if (eq != std::string::npos) {
+                error = "--dedup takes no value: " + arg;
+                return false;
+            }
+            server_config.dedup = true;
+        } else {
+            error = "Unknown option: " + arg;
+            return false;
+        }
+    }
+
+    // Spliced bodies never pass through user space, so they cannot be hashed.
+    if (server_config.dedup && server_config.upload_splice) {
+        error = "--dedup cannot be combined with --upload-splice";
+        return false;
+    }
+
+    // The io_uring engine reads bodies with provided buffers and never splices.
+    if (server_config.upload_splice && server_config.engine == EngineMode::IO_URING) {
+        error = "--upload-splice cannot be combined with --engine=io_uring";
+        return false;
+    }
+
+    return true;
+}
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --workers=N     Event loop workers, each with its own SO_REUSEPORT\n"
+              << "                  listener (default: one per available CPU)\n"
+              << "  --pin-cpus      Pin each worker thread to its own CPU\n"
+              << "  --engine=NAME   I/O engine: epoll or io_uring (default: epoll)\n"
+              << "  --keepalive-timeout=S\n"
+              << "                  Idle seconds before a persistent connection is\n"
+              << "                  closed; 0 disables keep-alive (default: 5)\n"
+              << "  --keepalive-requests=N\n"
+              << "                  Requests served per connection (default: 100)\n"
+              << "  --encoder=MODE  WebP encoder: native (in-process libwebp), script\n"
+              << "                  (compressor.sh) or auto (default: native if built in)\n"
+              << "  --compress-workers=N\n"
+              << "                  Concurrent WebP encodes (default: one per CPU)\n"
+              << "  --compress-queue=N\n"
+              << "                  Pending compression jobs allowed (default: 1024)\n"
+              << "  --compress-overflow=POLICY\n"
+              << "                  When the queue is full: reject (503) or wait for\n"
+              << "                  space, stalling that worker (default: reject)\n"
+              << "  --compress-mode=MODE\n"
+              << "                  eager (encode right after upload) or lazy (encode\n"
+              << "                  on the first GET of the WebP) (default: eager)\n"
+              << "  --compress-timeout=S\n"
+              << "                  Seconds before a compressor.sh run is killed\n"
+              << "                  (default: 120)\n"
+              << "  --pending=POLICY\n"
+              << "                  GET of a WebP still being encoded: original (serve\n"
+              << "                  the upload as-is), wait (until encoded) or 404\n"
+              << "                  (default: original)\n"
+              << "  --pending-timeout=S\n"
+              << "                  Longest a request waits for an encode before a 503\n"
+              << "                  (default: 10)\n"
+              << "  --variants=LIST Extra WebP sizes to encode, e.g. 320,640:70,1600\n"
+              << "                  (longest side[:quality], up to 16), served with\n"
+              << "                  /retrieve?name=...&w=N (default: none)\n"
+              << "  --resize-sizes=LIST\n"
+              << "                  Widths and heights allowed for on-the-fly resizing\n"
+              << "                  (/retrieve?...&w=&h=&fit=&q=), e.g. 100,200,400\n"
+              << "                  (default: none, resizing disabled)\n"
+              << "  --resize-qualities=LIST\n"
+              << "                  Qualities allowed for q (default: 50,65,80)\n"
+              << "  --journal-sync-ms=MS\n"
+              << "                  Interval at which compression journal records are\n"
+              << "                  written and fdatasync()ed together (default: 50)\n"
+              << "  --cache-size=MB Memory for hot /retrieve objects; 0 disables the\n"
+              << "                  cache (default: 64)\n"
+              << "  --log-flush-ms=MS\n"
+              << "                  Interval at which buffered log records are written\n"
+              << "                  (default: 100)\n"
+              << "  --log-overflow=POLICY\n"
+              << "                  When the log buffer is full: drop (counted and\n"
+              << "                  reported) or block the caller (default: drop)\n"
+              << "  --upload-splice Move upload bodies from the socket to disk with\n"
+              << "                  splice() instead of copying through user space\n"
+              << "                  (epoll engine only)\n"
+              << "  --dedup         Name uploads by the SHA-256 of their content and skip\n"
+              << "                  storing and compressing bodies already seen\n";
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+namespace ImageCurry {
+
+enum class EncoderMode {
+    AUTO,       // in-process encoder when built with libwebp, else compressor.sh
+    NATIVE,     // in-process libwebp encoder; compressor.sh only for formats it cannot decode
+    SCRIPT      // always fork compressor.sh (ImageMagick)
+};
+
+enum class EngineMode {
+    EPOLL,      // edge-triggered epoll reactor
+    IO_URING    // io_uring completion engine
+};
+
+enum class OverflowPolicy {
+    REJECT,     // answer 503 when the compression queue is full
+    WAIT        // accept the upload and wait for queue space
+};
+
+enum class CompressMode {
+    EAGER,      // queue the WebP encode as soon as the upload is stored
+    LAZY        // encode on the first request for the WebP
+};
+
+enum class PendingPolicy {
+    ORIGINAL,   // serve the uploaded original until its WebP is written
+    WAIT,       // hold the request until the encode finishes or times out
+    NOT_FOUND   // answer 404 as if the WebP did not exist
+};
+
+// An extra WebP encoded next to the default one (--variants). Like the
+// default, it is bounded to width x width, so width is its longest side.
+struct ImageVariant {
+    int width;
+    int quality;
+};
+
+constexpr size_t MAX_VARIANTS = 16;
+constexpr size_t MAX_RESIZE_VALUES = 32;
+
+enum class LogOverflow {
+    DROP,       // discard the record and count it
+    BLOCK       // wait for the writer thread to make room
+};
+
+// Runtime settings parsed from the command line. Populated once in main()
+// before any worker starts and read-only afterwards.
+struct ServerConfig {
+    int workers = 0;           // 0 = one worker per available CPU
+    bool pin_cpus = false;
+    EngineMode engine = EngineMode::EPOLL;
+    int keepalive_timeout = 5;      // seconds; 0 disables persistent connections
+    int keepalive_requests = 100;   // requests served before the server closes
+    EncoderMode encoder = EncoderMode::AUTO;
+    int compress_workers = 0;       // 0 = one encoder thread per CPU
+    int compress_queue = 1024;
+    OverflowPolicy compress_overflow = OverflowPolicy::REJECT;
+    CompressMode compress_mode = CompressMode::EAGER;
+    int compress_timeout = 120;     // seconds before compressor.sh is killed
+    PendingPolicy pending = PendingPolicy::ORIGINAL;
+    int pending_timeout = 10;       // seconds a request waits on an encode
+    std::vector<ImageVariant> variants;     // sorted by width
+    std::vector<int> resize_sizes;          // allowed w/h; empty disables resizing
+    std::vector<int> resize_qualities = {50, 65, 80};
+    bool upload_splice = false;     // move upload bodies socket -> pipe -> file
+    bool dedup = false;             // name uploads by the SHA-256 of their body
+    int journal_sync_ms = 50;       // compression journal group-commit interval
+    int cache_size_mb = 64;         // in-memory /retrieve cache; 0 disables it
+    int log_flush_ms = 100;         // how often the log writer thread drains
+    LogOverflow log_overflow = LogOverflow::DROP;
+};
+
+const ServerConfig& config();
+bool use_native_encoder();
+bool load_config(int argc, char** argv, std::string& error);
+void print_usage(const char* program);
+
+}
+#endif
@@ -0,0 +1,600 @@
+#include "connection.hpp"
+#include "handlers.hpp"
+#include "logging.hpp"
+#include "config.hpp"
+#include "compression.hpp"
+#include "object_cache.hpp"
+#include <algorithm>
+#include <charconv>
+
+namespace ImageCurry {
+
+Connection::Connection(int fd, const std::string& client_ip, int client_port,
+                       LoopNotifier& notifier, uint64_t key)
+    : fd_(fd), client_ip_(client_ip), client_port_(client_port),
+      notifier_(&notifier), key_(key), last_activity_(time(nullptr)) {
+    header_buf_.reserve(BUFFER_SIZE);
+}
+
+void Connection::on_input(const char* data, size_t len) {
+    while (len > 0 && wants_input()) {
+        size_t used = (state_ == ConnectionState::READING_HEADERS)
+                          ? consume_headers(data, len)
+                          : consume_body(data, len);
+        data += used;
+        len -= used;
+    }
+
+    bool responding = state_ == ConnectionState::OPENING || state_ == ConnectionState::ENCODING ||
+                      state_ == ConnectionState::WRITING;
+    if (len > 0 && responding && response_.keep_alive) {
+        pipelined_.append(data, len);
+    }
+}
+
+// A parked request is bounded by wait_deadline_ instead.
+bool Connection::timed_out(time_t now) const {
+    if (state_ == ConnectionState::ENCODING) {
+        return false;
+    }
+    bool idle_between_requests = state_ == ConnectionState::READING_HEADERS &&
+                                 header_buf_.empty() && requests_served_ > 0;
+    int limit = idle_between_requests ? config().keepalive_timeout : REQUEST_TIMEOUT;
+    return now - last_activity_ > limit;
+}
+
+size_t Connection::consume_headers(const char* data, size_t len) {
+    size_t old_size = header_buf_.size();
+    size_t room = BUFFER_SIZE - 1 - old_size;
+    size_t take = std::min(len, room);
+    header_buf_.append(data, take);
+
+    switch (parser_.parse(header_buf_, request_)) {
+    case ParseStatus::INCOMPLETE:
+        if (header_buf_.size() >= static_cast<size_t>(BUFFER_SIZE) - 1) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, "INVALID", "", 400,
+                    "Headers too large or malformed");
+            respond_error(400, "Headers too large or malformed");
+        }
+        return take;
+    case ParseStatus::FAILED:
+        log_msg(LogLevel::WARN, client_ip_, client_port_, "INVALID", "", 400,
+                parser_.error());
+        respond_error(400, parser_.error());
+        return take;
+    case ParseStatus::COMPLETE:
+        break;
+    }
+
+    // Bytes past the head belong to the body or the next request.
+    size_t header_len = parser_.consumed();
+    header_buf_.resize(header_len);
+    parse_headers();
+    return header_len - old_size;
+}
+
+// Upload bodies stream straight into the save directory; any other body is
+// read and discarded so the connection stays in sync for the next request.
+size_t Connection::consume_body(const char* data, size_t len) {
+    if (chunked_) {
+        return consume_chunked(data, len);
+    }
+
+    size_t n = std::min(len, content_length_ - body_len_);
+    if (upload_) {
+        upload_->write(data, n);
+    }
+    body_len_ += n;
+    if (body_len_ == content_length_) {
+        dispatch();
+    }
+    return n;
+}
+
+size_t Connection::consume_chunked(const char* data, size_t len) {
+    std::string_view payload;
+    size_t used = chunked_->decode(data, len, payload);
+    if (upload_ && !payload.empty()) {
+        upload_->write(payload.data(), payload.size());
+    }
+    body_len_ += payload.size();
+
+    if (chunked_->failed()) {
+        int code = chunked_->too_large() ? 413 : 400;
+        log_msg(LogLevel::WARN, client_ip_, client_port_, request_.method, request_.target, code,
+                chunked_->error());
+        upload_.reset();
+        respond_error(code, code == 413 ? "File too large" : "Malformed chunked body");
+    } else if (chunked_->done()) {
+        dispatch();
+    }
+    return used;
+}
+
+UploadSink* Connection::splice_sink() {
+    if (state_ != ConnectionState::READING_BODY || !upload_ || chunked_ ||
+        upload_->sink.failed()) {
+        return nullptr;
+    }
+    return &upload_->sink;
+}
+
+void Connection::on_body_spliced(size_t len) {
+    body_len_ += std::min(len, body_remaining());
+    if (body_len_ == content_length_) {
+        dispatch();
+    }
+}
+
+void Connection::on_file_opened(ScopedFileDescriptor file, const struct stat& st) {
+    bool is_head = request_.method == "HEAD";
+    if (serving_original_) {
+        state_ = ConnectionState::WRITING;
+        handle_retrieve_original(response_, retrieve_name_, open_path_, std::move(file), st,
+                                 client_ip_, client_port_, is_head);
+        return;
+    }
+
+    if (!file && !pending_checked_ && is_webp()) {
+        handle_pending();
+        if (state_ != ConnectionState::WRITING) {
+            return;
+        }
+    }
+
+    state_ = ConnectionState::WRITING;
+    handle_retrieve_file(response_, request_, retrieve_name_, std::move(file), st,
+                         cache_generation_, client_ip_, client_port_, is_head);
+}
+
+bool Connection::is_webp() const {
+    const std::string suffix = ".webp";
+    return retrieve_name_.size() > suffix.size() &&
+           retrieve_name_.compare(retrieve_name_.size() - suffix.size(), suffix.size(),
+                                  suffix) == 0;
+}
+
+// The WebP is missing: it may still be queued or encoding. Depending on
+// --pending the original is opened in its place, or the request waits for
+// the job. With --compress-mode=lazy, or for a resize, an encode is started
+// if none is pending, but only when the original exists: a name that was
+// never uploaded is answered 404 without taking a queue slot.
+// pending_checked_ stays set, so a second failed open is answered 404.
+// Leaves state_ WRITING when handle_retrieve_file() should answer 404.
+void Connection::handle_pending() {
+    pending_checked_ = true;
+    CompressionPool& pool = CompressionPool::get_instance();
+
+    // Resizes are made on demand, from the original, and always waited for.
+    if (!derived_name_.empty()) {
+        request_encode();
+        return;
+    }
+
+    if (config().pending == PendingPolicy::ORIGINAL) {
+        std::string original = pool.pending_original(base_name_);
+        if (!original.empty()) {
+            open_path_ = std::move(original);
+            serving_original_ = true;
+            state_ = ConnectionState::OPENING;
+            return;
+        }
+    }
+
+    if (config().compress_mode == CompressMode::LAZY) {
+        request_encode();
+        return;
+    }
+
+    state_ = ConnectionState::WRITING;
+    if (config().pending != PendingPolicy::NOT_FOUND) {
+        auto ticket = std::make_shared<WaitTicket>(WaitTicket{notifier_, key_});
+        if (pool.wait(base_name_, ticket)) {
+            wait_for(std::move(ticket));
+        } else {
+            // The job may have finished since the open failed, in which case
+            // the WebP is there now; look once more before answering 404.
+            state_ = ConnectionState::OPENING;
+        }
+    }
+}
+
+void Connection::request_encode() {
+    if (find_original(base_name_).empty()) {
+        state_ = ConnectionState::WRITING;
+        return;
+    }
+
+    CompressionPool& pool = CompressionPool::get_instance();
+    auto ticket = std::make_shared<WaitTicket>(WaitTicket{notifier_, key_});
+    bool queued = derived_name_.empty()
+                      ? pool.request(base_name_, ticket)
+                      : pool.request_resize(derived_name_, base_name_, resize_, ticket);
+    if (!queued) {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, request_.method, retrieve_name_, 503,
+                "Compression queue full");
+        send_error(response_, 503, "Compression queue full, retry later", "Retry-After: 5");
+        state_ = ConnectionState::WRITING;
+        return;
+    }
+    wait_for(std::move(ticket));
+}
+
+void Connection::wait_for(std::shared_ptr<WaitTicket> ticket) {
+    ticket_ = std::move(ticket);
+    wait_deadline_ = time(nullptr) + config().pending_timeout;
+    state_ = ConnectionState::ENCODING;
+}
+
+// The encode has finished (or failed); open the file again. The cache was
+// invalidated before the ticket was posted, so the generation is re-read to
+// let the fresh WebP be cached.
+void Connection::on_encoded() {
+    ticket_.reset();
+    cache_generation_ = ObjectCache::get_instance().generation();
+    state_ = ConnectionState::OPENING;
+}
+
+// The ticket is dropped so a late post is ignored by waiting_on().
+void Connection::on_wait_timeout() {
+    ticket_.reset();
+    log_msg(LogLevel::WARN, client_ip_, client_port_, request_.method, retrieve_name_, 503,
+            "Timed out waiting for encode");
+    send_error(response_, 503, "Image is still being encoded, retry later", "Retry-After: 1");
+    state_ = ConnectionState::WRITING;
+}
+
+void Connection::on_response_sent() {
+    if (continuing_) {
+        continuing_ = false;
+        response_ = Response();
+        state_ = ConnectionState::READING_BODY;
+        replay_pipelined();
+        return;
+    }
+
+    if (!response_.keep_alive) {
+        state_ = ConnectionState::CLOSED;
+        return;
+    }
+
+    requests_served_++;
+    reset_request();
+    replay_pipelined();
+}
+
+void Connection::replay_pipelined() {
+    if (!pipelined_.empty()) {
+        std::string pending;
+        pending.swap(pipelined_);
+        on_input(pending.data(), pending.size());
+    }
+}
+
+void Connection::reset_request() {
+    state_ = ConnectionState::READING_HEADERS;
+    header_buf_.clear();
+    parser_.reset();
+    request_ = HttpRequest();
+    upload_.reset();
+    chunked_.reset();
+    retrieve_name_.clear();
+    base_name_.clear();
+    derived_name_.clear();
+    open_path_.clear();
+    ticket_.reset();
+    wait_deadline_ = 0;
+    pending_checked_ = false;
+    serving_original_ = false;
+    content_length_ = 0;
+    body_len_ = 0;
+    keep_alive_ = false;
+    continuing_ = false;
+    response_ = Response();
+}
+
+// Errors raised while parsing leave the stream position unknown (the body may
+// not have been read), so the connection is always closed afterwards.
+void Connection::respond_error(int code, const std::string& message) {
+    response_.keep_alive = false;
+    send_error(response_, code, message);
+    state_ = ConnectionState::WRITING;
+}
+
+bool Connection::wants_keep_alive() const {
+    if (config().keepalive_timeout == 0 ||
+        requests_served_ + 1 >= config().keepalive_requests) {
+        return false;
+    }
+
+    bool keep_alive = (request_.version == "HTTP/1.1");
+
+    if (const HttpHeader* connection = request_.find("Connection")) {
+        if (header_has_token(connection->value, "close")) {
+            keep_alive = false;
+        } else if (header_has_token(connection->value, "keep-alive")) {
+            keep_alive = true;
+        }
+    }
+
+    return keep_alive;
+}
+
+void Connection::parse_headers() {
+    std::string_view method = request_.method;
+    std::string_view target = request_.target;
+
+    if (request_.version != "HTTP/1.1" && request_.version != "HTTP/1.0") {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                "Invalid HTTP version: " + std::string(request_.version));
+        respond_error(400, "Invalid HTTP version");
+        return;
+    }
+
+    keep_alive_ = wants_keep_alive();
+
+    if (method == "OPTIONS") {
+        dispatch();
+        return;
+    }
+
+    // With Expect: 100-continue the client holds the body back until told to
+    // send it, so everything that can be judged from the headers is checked
+    // first and a rejection costs no upload bandwidth.
+    bool expect_continue = false;
+    if (const HttpHeader* expect = request_.find("Expect")) {
+        if (!iequals(expect->value, "100-continue")) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 417,
+                    "Unsupported Expect: " + std::string(expect->value));
+            respond_error(417, "Unsupported expectation");
+            return;
+        }
+        // HTTP/1.0 clients do not understand interim responses.
+        expect_continue = (request_.version == "HTTP/1.1");
+    }
+
+    bool is_upload = (method == "POST" && request_.path == "/upload");
+
+    if (const HttpHeader* header = request_.find("Transfer-Encoding")) {
+        if (!iequals(header->value, "chunked")) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 501,
+                    "Unsupported Transfer-Encoding: " + std::string(header->value));
+            respond_error(501, "Unsupported Transfer-Encoding");
+            return;
+        }
+        // A request carrying both is framed differently by different
+        // parsers, the basis of request smuggling (RFC 9112 section 6.3).
+        if (request_.has_header("Content-Length")) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Both Transfer-Encoding and Content-Length");
+            respond_error(400, "Both Transfer-Encoding and Content-Length");
+            return;
+        }
+        chunked_ = std::make_unique<ChunkedDecoder>(is_upload ? MAX_FILE_SIZE : MAX_REQUEST_SIZE);
+    } else if (const HttpHeader* header = request_.find("Content-Length")) {
+        std::string_view value = header->value;
+        for (size_t i = 0; i < request_.header_count; i++) {
+            const HttpHeader& other = request_.headers[i];
+            if (iequals(other.name, "Content-Length") && other.value != value) {
+                log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                        "Conflicting Content-Length headers");
+                respond_error(400, "Conflicting Content-Length");
+                return;
+            }
+        }
+
+        unsigned long long content_length = 0;
+        auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(),
+                                         content_length);
+        bool too_large = ec == std::errc::result_out_of_range;
+        if (!too_large && (ec != std::errc() || end != value.data() + value.size())) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Invalid Content-Length");
+            respond_error(400, "Invalid Content-Length");
+            return;
+        }
+        if (too_large || content_length > MAX_REQUEST_SIZE) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 413,
+                    "Content-Length exceeds the request size limit");
+            respond_error(413, "Payload Too Large");
+            return;
+        }
+
+        content_length_ = static_cast<size_t>(content_length);
+    }
+
+    bool has_body = content_length_ > 0 || chunked_;
+
+    if (expect_continue && has_body && method == "POST" && !is_upload) {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                "Invalid path for POST - only /upload is supported");
+        respond_error(400, "Invalid path - POST only accepts /upload");
+        return;
+    }
+
+    if (is_upload) {
+        upload_ = std::make_unique<Upload>();
+        if (!begin_upload(response_, *upload_, request_, content_length_,
+                          client_ip_, client_port_)) {
+            upload_.reset();
+            response_.keep_alive = false;
+            state_ = ConnectionState::WRITING;
+            return;
+        }
+    }
+
+    if (has_body) {
+        if (expect_continue) {
+            // keep_alive holds on to body bytes sent before the 100 arrives.
+            send_continue(response_);
+            response_.keep_alive = true;
+            continuing_ = true;
+            state_ = ConnectionState::WRITING;
+            return;
+        }
+        state_ = ConnectionState::READING_BODY;
+        return;
+    }
+
+    dispatch();
+}
+
+// "<uuid>.webp", as opposed to a variant or any other file.
+static bool is_default_webp(const std::string& filename) {
+    const std::string suffix = ".webp";
+    return filename.size() > suffix.size() &&
+           filename.find('.') == filename.size() - suffix.size() &&
+           filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// The smallest --variants output at least w pixels wide, else the largest.
+static std::string select_variant(const std::string& filename, int w) {
+    const std::vector<ImageVariant>& variants = config().variants;
+    auto it = std::find_if(variants.begin(), variants.end(),
+                           [w](const ImageVariant& v) { return v.width >= w; });
+    return variant_name(filename, it == variants.end() ? variants.back().width : it->width);
+}
+
+static bool parse_positive(const std::string& value, int& out) {
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), out);
+    return ec == std::errc() && end == value.data() + value.size() && out > 0;
+}
+
+static bool allowed(const std::vector<int>& values, int value) {
+    return std::binary_search(values.begin(), values.end(), value);
+}
+
+// "<uuid>.<w>x<h>.<fit>.q<q>.webp": one name per distinct output, so
+// equivalent queries share a file.
+static std::string derived_file_name(const std::string& filename, const ResizeSpec& spec) {
+    return filename.substr(0, filename.size() - 5) + "." + std::to_string(spec.width) + "x" +
+           std::to_string(spec.height) + (spec.fit == ResizeFit::COVER ? ".cover" : ".inside") +
+           ".q" + std::to_string(spec.quality) + ".webp";
+}
+
+// Applies w, h, fit and q to a default WebP request. A lone w picks a
+// --variants output when there are any; otherwise the parameters describe an
+// on-the-fly resize (--resize-sizes), served from DERIVED_DIR under a
+// DERIVED_CACHE_PREFIX name. Parameters that no feature is enabled for are
+// ignored. Returns false once a 400 has been prepared.
+bool Connection::select_size(std::string& filename) {
+    std::string w, h, fit, q;
+    bool has_w = get_query_param(request_.query, "w", w);
+    bool has_h = get_query_param(request_.query, "h", h);
+    bool has_fit = get_query_param(request_.query, "fit", fit);
+    bool has_q = get_query_param(request_.query, "q", q);
+    if (!has_w && !has_h && !has_fit && !has_q) {
+        return true;
+    }
+
+    ResizeSpec spec{0, 0, ResizeFit::INSIDE, static_cast<int>(WEBP_QUALITY)};
+    bool valid = (!has_w || parse_positive(w, spec.width)) &&
+                 (!has_h || parse_positive(h, spec.height)) &&
+                 (!has_q || parse_positive(q, spec.quality)) &&
+                 (!has_fit || fit == "inside" || fit == "cover");
+    if (!valid) {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, request_.method, request_.target, 400,
+                "Invalid resize parameters");
+        send_error(response_, 400, "Invalid resize parameters");
+        return false;
+    }
+
+    if (!is_default_webp(filename)) {
+        return true;
+    }
+
+    bool width_only = has_w && !has_h && !has_fit && !has_q;
+    if (width_only && !config().variants.empty()) {
+        filename = select_variant(filename, spec.width);
+        return true;
+    }
+
+    const ServerConfig& cfg = config();
+    if (cfg.resize_sizes.empty()) {
+        return true;
+    }
+
+    if ((has_w && !allowed(cfg.resize_sizes, spec.width)) ||
+        (has_h && !allowed(cfg.resize_sizes, spec.height)) ||
+        (has_q && !allowed(cfg.resize_qualities, spec.quality))) {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, request_.method, request_.target, 400,
+                "Resize parameters not in allow-list");
+        send_error(response_, 400, "Resize parameters not allowed");
+        return false;
+    }
+
+    // Cover needs both sides; with one it is the same as inside.
+    if (fit == "cover" && spec.width > 0 && spec.height > 0) {
+        spec.fit = ResizeFit::COVER;
+    }
+    resize_ = spec;
+    derived_name_ = derived_file_name(filename, spec);
+    filename = DERIVED_CACHE_PREFIX + derived_name_;
+    return true;
+}
+
+void Connection::dispatch() {
+    std::string_view method = request_.method;
+    std::string_view target = request_.target;
+
+    state_ = ConnectionState::WRITING;
+    response_.keep_alive = keep_alive_;
+
+    if (method == "OPTIONS") {
+        handle_options(response_, client_ip_, client_port_);
+        return;
+    }
+
+    if (method == "POST") {
+        if (!upload_) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Invalid path for POST - only /upload is supported");
+            send_error(response_, 400, "Invalid path - POST only accepts /upload");
+            return;
+        }
+        handle_upload(response_, *upload_, client_ip_, client_port_);
+        upload_.reset();
+    } else if (method == "GET" || method == "HEAD") {
+        if (request_.path != "/retrieve") {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Invalid path - GET/HEAD only accepts /retrieve");
+            send_error(response_, 400, "Invalid path - GET/HEAD only accepts /retrieve");
+            return;
+        }
+
+        std::string filename;
+        if (request_.query.empty() || !get_query_param(request_.query, "name", filename)) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Missing 'name' parameter");
+            send_error(response_, 400, "Missing 'name' parameter");
+            return;
+        }
+
+        if (!valid_filename(filename)) {
+            log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 400,
+                    "Invalid filename: " + filename);
+            send_error(response_, 400, "Invalid filename");
+            return;
+        }
+
+        base_name_ = filename;
+        if (!select_size(filename)) {
+            return;
+        }
+
+        bool is_head = (method == "HEAD");
+        if (!handle_retrieve_cached(response_, request_, filename, client_ip_, client_port_,
+                                    is_head, cache_generation_)) {
+            retrieve_name_ = filename;
+            open_path_ = derived_name_.empty() ? build_serve_path(filename)
+                                               : build_derived_path(derived_name_);
+            state_ = ConnectionState::OPENING;
+        }
+    } else {
+        log_msg(LogLevel::WARN, client_ip_, client_port_, method, target, 501,
+                "Method not implemented");
+        send_error(response_, 501, "Method not implemented");
+    }
+}
+
+}
@@ -0,0 +1,140 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "chunked_decoder.hpp"
+#include "http_request.hpp"
+#include "http_response.hpp"
+#include "image_codec.hpp"
+#include "loop_notifier.hpp"
+#include "handlers.hpp"
+#include "utils.hpp"
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <ctime>
+#include <cstdint>
+#include <sys/stat.h>
+
+namespace ImageCurry {
+
+constexpr int REQUEST_TIMEOUT = 30;
+constexpr size_t MAX_REQUEST_SIZE = 128 * 1024 * 1024;
+
+enum class ConnectionState {
+    READING_HEADERS,
+    READING_BODY,
+    OPENING,        // waiting for the engine to open the requested file
+    ENCODING,       // waiting for an on-demand encode of the requested file
+    WRITING,
+    CLOSED
+};
+
+// Per-client HTTP state machine. The I/O engine feeds received bytes in with
+// on_input() and drains response() once the state becomes WRITING; the
+// connection itself never touches the socket. In OPENING the engine opens
+// open_path() (blocking or asynchronously) and reports it via on_file_opened().
+// In ENCODING the connection is parked until its WaitTicket is posted to the
+// engine's LoopNotifier; the engine then calls on_encoded() and the file is
+// opened again, or on_wait_timeout() once wait_expired(). Persistent
+// connections return to READING_HEADERS after each response, replaying any
+// pipelined bytes that arrived behind the previous request.
+class Connection {
+public:
+    // notifier and key tell other threads how to wake this connection.
+    Connection(int fd, const std::string& client_ip, int client_port,
+               LoopNotifier& notifier, uint64_t key);
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    int fd() const { return fd_.get(); }
+    const std::string& client_ip() const { return client_ip_; }
+    int client_port() const { return client_port_; }
+    ConnectionState state() const { return state_; }
+    bool wants_input() const {
+        return state_ == ConnectionState::READING_HEADERS ||
+               state_ == ConnectionState::READING_BODY;
+    }
+
+    void on_input(const char* data, size_t len);
+    void on_response_sent();
+
+    // Upload body bytes may bypass on_input(): the engine moves up to
+    // body_remaining() bytes into splice_sink()'s file itself and reports them
+    // with on_body_spliced(). Returns nullptr when the body must be read
+    // normally (not an upload, a chunked body, or the sink has already failed).
+    UploadSink* splice_sink();
+    size_t body_remaining() const { return content_length_ - body_len_; }
+    void on_body_spliced(size_t len);
+
+    const std::string& open_path() const { return open_path_; }
+    void on_file_opened(ScopedFileDescriptor file, const struct stat& st);
+
+    bool waiting_on(const WaitTicket* ticket) const {
+        return state_ == ConnectionState::ENCODING && ticket_.get() == ticket;
+    }
+    void on_encoded();
+    bool wait_expired(time_t now) const {
+        return state_ == ConnectionState::ENCODING && now >= wait_deadline_;
+    }
+    void on_wait_timeout();
+
+    Response& response() { return response_; }
+
+    void touch(time_t now) { last_activity_ = now; }
+    bool timed_out(time_t now) const;
+
+private:
+    size_t consume_headers(const char* data, size_t len);
+    size_t consume_body(const char* data, size_t len);
+    size_t consume_chunked(const char* data, size_t len);
+    void parse_headers();
+    bool wants_keep_alive() const;
+    void dispatch();
+    bool select_size(std::string& filename);
+    void replay_pipelined();
+    bool is_webp() const;
+    void handle_pending();
+    void request_encode();
+    void wait_for(std::shared_ptr<WaitTicket> ticket);
+    void respond_error(int code, const std::string& message);
+    void reset_request();
+
+    ScopedFileDescriptor fd_;
+    std::string client_ip_;
+    int client_port_;
+    LoopNotifier* notifier_;
+    uint64_t key_;
+    ConnectionState state_ = ConnectionState::READING_HEADERS;
+    time_t last_activity_;
+    int requests_served_ = 0;
+
+    // Request head; request_ holds views into it, so it is reserved up front
+    // and never reallocated before reset_request().
+    std::string header_buf_;
+    std::string pipelined_;
+
+    RequestParser parser_;
+    HttpRequest request_;
+    std::unique_ptr<Upload> upload_;
+    std::unique_ptr<ChunkedDecoder> chunked_;   // set for Transfer-Encoding: chunked
+    std::string retrieve_name_;
+    std::string base_name_;         // the WebP whose encode produces retrieve_name_
+    std::string derived_name_;      // set for an on-the-fly resize of base_name_
+    ResizeSpec resize_{};
+    std::string open_path_;
+    uint64_t cache_generation_ = 0;
+    std::shared_ptr<WaitTicket> ticket_;
+    time_t wait_deadline_ = 0;
+    bool pending_checked_ = false;      // the missing WebP was looked up in the pool
+    bool serving_original_ = false;     // open_path_ is the original, not the WebP
+    size_t content_length_ = 0;
+    size_t body_len_ = 0;
+    bool keep_alive_ = false;
+    bool continuing_ = false;       // response_ holds a 100 Continue
+
+    Response response_;
+};
+
+}
+#endif
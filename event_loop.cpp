@@ -0,0 +1,434 @@
+#include "event_loop.hpp"
+#include "logging.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+namespace ImageCurry {
+
+EventLoop::EventLoop(int listen_fd) : listen_fd_(listen_fd), chunk_(READ_CHUNK_SIZE) {}
+
+bool EventLoop::init() {
+    int flags = fcntl(listen_fd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to make listener non-blocking: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    epoll_fd_ = ScopedFileDescriptor(epoll_create1(EPOLL_CLOEXEC));
+    if (!epoll_fd_) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to create epoll instance: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd_;
+    if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to register listener: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    if (!notifier_.init()) {
+        return false;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = notifier_.fd();
+    if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, notifier_.fd(), &ev) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to register notifier: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    if (config().upload_splice && !open_splice_pipe()) {
+        return false;
+    }
+
+    return true;
+}
+
+bool EventLoop::open_splice_pipe() {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to create splice pipe: " + std::string(strerror(errno)));
+        return false;
+    }
+    splice_read_.reset(fds[0]);
+    splice_write_.reset(fds[1]);
+
+    // A larger pipe moves more per syscall pair; the default (64K) still works
+    // if the pipe-max-size limit refuses this.
+    fcntl(splice_write_.get(), F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    return true;
+}
+
+void EventLoop::run(const volatile sig_atomic_t& running) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    time_t last_sweep = time(nullptr);
+
+    while (running) {
+        int n = epoll_wait(epoll_fd_.get(), events, MAX_EPOLL_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                    "epoll_wait failed: " + std::string(strerror(errno)));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd_) {
+                accept_connections();
+                continue;
+            }
+            if (fd == notifier_.fd()) {
+                wake_waiters();
+                continue;
+            }
+
+            auto it = connections_.find(fd);
+            if (it != connections_.end()) {
+                handle_event(*it->second, events[i].events);
+            }
+        }
+
+        time_t now = time(nullptr);
+        if (now != last_sweep) {
+            close_idle(now);
+            last_sweep = now;
+        }
+    }
+
+    connections_.clear();
+}
+
+void EventLoop::accept_connections() {
+    while (true) {
+        struct sockaddr_in client_addr = {};
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(listen_fd_, (struct sockaddr *)&client_addr, &client_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                        "Accept failed: " + std::string(strerror(errno)));
+            }
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        int client_port = ntohs(client_addr.sin_port);
+
+        auto conn = std::make_unique<Connection>(client_fd, std::string(client_ip), client_port,
+                                                 notifier_, static_cast<uint64_t>(client_fd));
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_fd;
+        if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            log_msg(LogLevel::ERROR, client_ip, client_port, "", "", 0,
+                    "Failed to register connection: " + std::string(strerror(errno)));
+            continue;
+        }
+
+        connections_[client_fd] = std::move(conn);
+    }
+}
+
+// Tickets are keyed by fd; a connection that closed in the meantime (or a new
+// one that reused its fd) does not hold the ticket and is left alone.
+void EventLoop::wake_waiters() {
+    for (auto& ticket : notifier_.drain()) {
+        auto it = connections_.find(static_cast<int>(ticket->key));
+        if (it != connections_.end() && it->second->waiting_on(ticket.get())) {
+            it->second->on_encoded();
+            handle_event(*it->second, 0);
+        }
+    }
+}
+
+void EventLoop::handle_event(Connection& conn, uint32_t events) {
+    int fd = conn.fd();
+
+    if (events & EPOLLERR) {
+        close_connection(fd);
+        return;
+    }
+
+    // Edge-triggered: keep cycling between reading and writing until the
+    // socket blocks, so pipelined requests already buffered in the kernel are
+    // served without waiting for a new readiness edge.
+    while (true) {
+        if (conn.wants_input()) {
+            IoStatus status = read_input(conn);
+            if (status == IoStatus::FAILED) {
+                close_connection(fd);
+                return;
+            }
+            if (status == IoStatus::BLOCKED) {
+                return;
+            }
+        }
+
+        if (conn.state() == ConnectionState::OPENING) {
+            open_file(conn);
+        }
+
+        if (conn.state() == ConnectionState::ENCODING) {
+            return;
+        }
+
+        if (conn.state() == ConnectionState::WRITING) {
+            IoStatus status = write_output(conn);
+            if (status == IoStatus::FAILED) {
+                close_connection(fd);
+                return;
+            }
+            if (status == IoStatus::BLOCKED) {
+                return;
+            }
+        }
+
+        if (conn.state() == ConnectionState::CLOSED) {
+            close_connection(fd);
+            return;
+        }
+    }
+}
+
+IoStatus EventLoop::read_input(Connection& conn) {
+    while (conn.wants_input()) {
+        UploadSink* sink = splice_write_ ? conn.splice_sink() : nullptr;
+        if (sink) {
+            IoStatus status = splice_body(conn, *sink);
+            if (status != IoStatus::DONE) {
+                return status;
+            }
+            continue;
+        }
+
+        ssize_t n = recv(conn.fd(), chunk_.data(), chunk_.size(), 0);
+        if (n > 0) {
+            conn.touch(time(nullptr));
+            conn.on_input(chunk_.data(), static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0) {
+            return IoStatus::FAILED;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return IoStatus::BLOCKED;
+        }
+        log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                "Receive error: " + std::string(strerror(errno)));
+        return IoStatus::FAILED;
+    }
+    return IoStatus::DONE;
+}
+
+// Moves the upload body socket -> pipe -> file without copying it through
+// user space. Returns DONE once the body is complete or the sink has failed
+// (the remainder is then read and discarded through on_input()).
+IoStatus EventLoop::splice_body(Connection& conn, UploadSink& sink) {
+    while (conn.splice_sink() == &sink) {
+        size_t want = std::min(conn.body_remaining(), static_cast<size_t>(SPLICE_PIPE_SIZE));
+
+        // The magic bytes never reach user space once spliced, so peek at
+        // them first and never move past what has been peeked.
+        if (sink.size() < MAGIC_PREFIX_LEN) {
+            char prefix[MAGIC_PREFIX_LEN];
+            size_t need = std::min(want, MAGIC_PREFIX_LEN - sink.size());
+            ssize_t n = recv(conn.fd(), prefix, need, MSG_PEEK);
+            if (n == 0) {
+                return IoStatus::FAILED;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return IoStatus::BLOCKED;
+                }
+                log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                        "Receive error: " + std::string(strerror(errno)));
+                return IoStatus::FAILED;
+            }
+            sink.peeked(prefix, static_cast<size_t>(n));
+            want = static_cast<size_t>(n);
+        }
+
+        ssize_t n = splice(conn.fd(), nullptr, splice_write_.get(), nullptr, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            return IoStatus::FAILED;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IoStatus::BLOCKED;
+            }
+            log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                    "Splice from socket failed: " + std::string(strerror(errno)));
+            return IoStatus::FAILED;
+        }
+
+        conn.touch(time(nullptr));
+        drain_splice_pipe(sink, static_cast<size_t>(n));
+        conn.on_body_spliced(static_cast<size_t>(n));
+    }
+    return IoStatus::DONE;
+}
+
+// Empties the pipe into the upload file. If the file write fails the sink is
+// marked failed and the remaining bytes are read out and dropped, so the pipe
+// is clean for the next connection.
+void EventLoop::drain_splice_pipe(UploadSink& sink, size_t len) {
+    while (len > 0) {
+        ssize_t n = -1;
+        if (!sink.failed()) {
+            n = splice(splice_read_.get(), nullptr, sink.fd(), nullptr, len, SPLICE_F_MOVE);
+            if (n > 0) {
+                sink.spliced(static_cast<size_t>(n));
+                len -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            sink.fail(n == 0 ? EIO : errno);
+        }
+
+        n = read(splice_read_.get(), chunk_.data(), std::min(len, chunk_.size()));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            // Cannot tell what is left in the pipe; start over with a new one.
+            if (!open_splice_pipe()) {
+                splice_read_.reset();
+                splice_write_.reset();
+            }
+            return;
+        }
+        len -= static_cast<size_t>(n);
+    }
+}
+
+void EventLoop::open_file(Connection& conn) {
+    ScopedFileDescriptor file(open(conn.open_path().c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st = {};
+    if (file && fstat(file.get(), &st) != 0) {
+        file.reset();
+    }
+    conn.on_file_opened(std::move(file), st);
+}
+
+IoStatus EventLoop::write_output(Connection& conn) {
+    Response& res = conn.response();
+
+    // MSG_MORE holds the header back so it leaves in the same segment as the
+    // first bytes of the file body.
+    int header_flags = MSG_NOSIGNAL | (res.file_remaining > 0 ? MSG_MORE : 0);
+
+    // Header and in-memory body go out together in one gathered send.
+    while (res.data_sent < res.data.size() || res.body_remaining() > 0) {
+        struct iovec iov[2];
+        int iov_count = 0;
+        if (res.data_sent < res.data.size()) {
+            iov[iov_count].iov_base = const_cast<char*>(res.data.data()) + res.data_sent;
+            iov[iov_count].iov_len = res.data.size() - res.data_sent;
+            iov_count++;
+        }
+        if (res.body_remaining() > 0) {
+            iov[iov_count].iov_base = const_cast<char*>(res.body->data()) + res.body_sent;
+            iov[iov_count].iov_len = res.body_remaining();
+            iov_count++;
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_count;
+
+        ssize_t n = sendmsg(conn.fd(), &msg, header_flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IoStatus::BLOCKED;
+            log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                    "Failed to send response: " + std::string(strerror(errno)));
+            return IoStatus::FAILED;
+        }
+
+        size_t sent = static_cast<size_t>(n);
+        size_t header_part = std::min(sent, res.data.size() - res.data_sent);
+        res.data_sent += header_part;
+        res.body_sent += sent - header_part;
+        conn.touch(time(nullptr));
+    }
+
+    while (res.file_remaining > 0) {
+        ssize_t n = sendfile(conn.fd(), res.file.get(), &res.file_offset, res.file_remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IoStatus::BLOCKED;
+            log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                    "Failed to send data at offset " + std::to_string(res.file_offset) +
+                    ": " + std::string(strerror(errno)));
+            return IoStatus::FAILED;
+        }
+        if (n == 0) {
+            log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                    "File truncated while sending at offset " +
+                    std::to_string(res.file_offset));
+            return IoStatus::FAILED;
+        }
+        res.file_remaining -= static_cast<size_t>(n);
+        conn.touch(time(nullptr));
+    }
+
+    conn.on_response_sent();
+    return IoStatus::DONE;
+}
+
+// Client sockets are close-on-exec and never duplicated, so closing the
+// descriptor (in the connection's destructor) also removes it from epoll.
+void EventLoop::close_connection(int fd) {
+    connections_.erase(fd);
+}
+
+void EventLoop::close_idle(time_t now) {
+    // Answering an expired wait may close its connection, so collect first.
+    std::vector<int> expired;
+    for (auto& entry : connections_) {
+        if (entry.second->wait_expired(now)) {
+            expired.push_back(entry.first);
+        }
+    }
+    for (int fd : expired) {
+        Connection& conn = *connections_[fd];
+        conn.on_wait_timeout();
+        handle_event(conn, 0);
+    }
+
+    for (auto it = connections_.begin(); it != connections_.end(); ) {
+        if (it->second->timed_out(now)) {
+            epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, it->first, nullptr);
+            it = connections_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
@@ -0,0 +1,63 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "connection.hpp"
+#include "io_engine.hpp"
+#include "loop_notifier.hpp"
+#include "utils.hpp"
+#include <csignal>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace ImageCurry {
+
+constexpr int MAX_EPOLL_EVENTS = 256;
+constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+constexpr int SPLICE_PIPE_SIZE = 1024 * 1024;
+
+enum class IoStatus {
+    BLOCKED,    // socket would block; wait for the next readiness event
+    DONE,       // finished the current phase without blocking
+    FAILED      // peer went away or a hard error occurred
+};
+
+// Edge-triggered epoll reactor: accepts on a non-blocking listener and drives
+// every client Connection through its read/write states on a single thread.
+class EventLoop : public IoEngine {
+public:
+    explicit EventLoop(int listen_fd);
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool init() override;
+    void run(const volatile sig_atomic_t& running) override;
+
+private:
+    void accept_connections();
+    void wake_waiters();
+    void handle_event(Connection& conn, uint32_t events);
+    IoStatus read_input(Connection& conn);
+    IoStatus splice_body(Connection& conn, UploadSink& sink);
+    bool open_splice_pipe();
+    void drain_splice_pipe(UploadSink& sink, size_t len);
+    void open_file(Connection& conn);
+    IoStatus write_output(Connection& conn);
+    void close_connection(int fd);
+    void close_idle(time_t now);
+
+    int listen_fd_;
+    ScopedFileDescriptor epoll_fd_;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+    std::vector<char> chunk_;
+    LoopNotifier notifier_;
+
+    // Only used with --upload-splice. Always empty between calls so it can
+    // be shared by every connection on this loop.
+    ScopedFileDescriptor splice_read_;
+    ScopedFileDescriptor splice_write_;
+};
+
+}
+#endif
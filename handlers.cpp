@@ -2,246 +2,364 @@
 #include "http_response.hpp"
 #include "utils.hpp"
 #include "logging.hpp"
+#include "compression.hpp"
+#include "object_cache.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <cctype>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
-#include <signal.h>
-#include <fstream>
-#include <memory>
-#include <vector>
 
 namespace ImageCurry {
 
 constexpr const char* CORS_HEADERS =
     "Access-Control-Allow-Origin: *\r\n"
     "Access-Control-Allow-Methods: GET, POST, HEAD, OPTIONS\r\n"
-    "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization\r\n"
+    "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization, X-Priority\r\n"
     "Access-Control-Expose-Headers: Content-Length, Content-Type\r\n"
     "Access-Control-Max-Age: 86400\r\n"
     "Vary: Origin\r\n";
 
-void handle_options(int fd, const std::string& client_ip, int client_port) {
+void handle_options(Response& res, const std::string& client_ip, int client_port) {
     std::string header =
         "HTTP/1.1 204 No Content\r\n"
         "Access-Control-Allow-Origin: *\r\n"
         "Access-Control-Allow-Methods: GET, POST, HEAD, OPTIONS\r\n"
-        "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization\r\n"
+        "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization, X-Priority\r\n"
         "Access-Control-Expose-Headers: Content-Length, Content-Type\r\n"
         "Access-Control-Max-Age: 86400\r\n"
-        "Vary: Origin\r\n"
-        "Connection: close\r\n"
-        "\r\n";
+        "Vary: Origin\r\n";
+    header += connection_header(res) + "\r\n";
 
-    send(fd, header.data(), header.size(), 0);
+    res.data = std::move(header);
+    res.data_sent = 0;
 
     log_msg(LogLevel::INFO, client_ip, client_port, "OPTIONS", "*", 204,
             "CORS preflight");
 }
 
-void compress_to_webp_background(const std::string& input_path,
-                                  const std::string& output_path) {
-    char exe_path[4096];
-    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
-    if (len == -1) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "Failed to get executable path");
-        return;
+static bool matches_if_none_match(const HttpRequest& request, const std::string& etag) {
+    const HttpHeader* if_none_match = request.find("If-None-Match");
+    return if_none_match && if_none_match->value.find(etag) != std::string_view::npos;
+}
+
+// Everything but the Connection line and the terminating blank line, so the
+// same header can be cached and reused across connections.
+static std::string build_retrieve_header(const std::string& content_type, off_t size,
+                                         const std::string& etag,
+                                         const std::string& last_modified,
+                                         const std::string& cache_control =
+                                             "public, max-age=31536000, immutable") {
+    std::string extra =
+        "Last-Modified: " + last_modified + "\r\n" +
+        "ETag: " + etag + "\r\n" +
+        "Cache-Control: " + cache_control;
+
+    std::string header = "HTTP/1.1 200 OK\r\n";
+    header += CORS_HEADERS;
+    header += "Content-Type: " + content_type + "\r\n";
+    header += "Content-Length: " + std::to_string(size) + "\r\n";
+    header += extra + "\r\n";
+    return header;
+}
+
+// Reads a small serve-directory file into a cacheable object. Fails if the
+// file changes size underneath us (e.g. compressor.sh still writing it).
+static std::shared_ptr<CachedObject> load_object(int fd, const struct stat& st,
+                                                 const std::string& filename) {
+    auto object = std::make_shared<CachedObject>();
+    object->body.resize(static_cast<size_t>(st.st_size));
+
+    size_t done = 0;
+    while (done < object->body.size()) {
+        ssize_t n = pread(fd, &object->body[done], object->body.size() - done,
+                          static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return nullptr;
+        }
+        done += static_cast<size_t>(n);
     }
-    exe_path[len] = '\0';
 
-    char* last_slash = strrchr(exe_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
+    object->last_modified = format_http_date(st.st_mtime);
+    object->etag = generate_etag(st);
+    object->header = build_retrieve_header(get_content_type(filename), st.st_size,
+                                           object->etag, object->last_modified);
+    return object;
+}
+
+static void send_cached(Response& res, const HttpRequest& request,
+                        const std::string& filename,
+                        const std::shared_ptr<const CachedObject>& object,
+                        const std::string& client_ip, int client_port, bool is_head) {
+    if (!is_head && matches_if_none_match(request, object->etag)) {
+        log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 304,
+                "Cache hit (ETag)");
+        send_not_modified(res, object->etag, object->last_modified);
+        return;
     }
 
-    std::string compressor_path = std::string(exe_path) + "/compressor.sh";
+    res.data = object->header + connection_header(res) + "\r\n";
+    res.data_sent = 0;
 
-    struct stat st;
-    if (stat(compressor_path.c_str(), &st) != 0) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "compressor.sh not found at " + compressor_path);
+    if (is_head) {
+        log_msg(LogLevel::INFO, client_ip, client_port, "HEAD", filename, 200,
+                "Metadata sent from memory cache");
         return;
     }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        signal(SIGCHLD, SIG_DFL);
-        chdir(exe_path);
-        sleep(1);
+    res.body = std::shared_ptr<const std::string>(object, &object->body);
+    res.body_sent = 0;
+
+    log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 200,
+            "Sending " + std::to_string(object->body.size()) + " bytes from memory cache");
+}
+
+bool handle_retrieve_cached(Response& res, const HttpRequest& request,
+                            const std::string& filename,
+                            const std::string& client_ip, int client_port, bool is_head,
+                            uint64_t& cache_generation) {
+    ObjectCache& cache = ObjectCache::get_instance();
+    if (!cache.enabled()) {
+        return false;
+    }
 
-        std::string cmd = "'" + std::string(exe_path) + "/compressor.sh' '" +
-                          input_path + "' '" + output_path + "'";
-        system(cmd.c_str());
-        _exit(0);
-    } else if (pid < 0) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "Fork failed for compression");
+    std::shared_ptr<const CachedObject> object = cache.lookup(filename);
+    if (!object) {
+        cache_generation = cache.generation();
+        return false;
     }
+
+    send_cached(res, request, filename, object, client_ip, client_port, is_head);
+    return true;
 }
 
-void handle_retrieve(int fd, const std::string& request, const std::string& filename,
-                     const std::string& client_ip, int client_port, bool is_head) {
-    std::string filepath = build_serve_path(filename);
+void handle_retrieve_file(Response& res, const HttpRequest& request, const std::string& filename,
+                          ScopedFileDescriptor file, const struct stat& st,
+                          uint64_t cache_generation,
+                          const std::string& client_ip, int client_port, bool is_head) {
+    ObjectCache& cache = ObjectCache::get_instance();
 
-    struct stat st;
-    if (stat(filepath.c_str(), &st) != 0) {
+    if (!file) {
         log_msg(LogLevel::INFO, client_ip, client_port, is_head ? "HEAD" : "GET", filename, 404,
                 "File not found in serve directory");
-        send_error(fd, 404, "File not found");
+        send_error(res, 404, "File not found");
         return;
     }
 
-    std::string last_modified = format_http_date(st.st_mtime);
-    std::string etag = generate_etag(st);
-    std::string content_type = get_content_type(filename);
-
-    auto if_none_match_pos = request.find("If-None-Match:");
-    if (if_none_match_pos != std::string::npos && !is_head) {
-        auto etag_pos = request.find(etag, if_none_match_pos);
-        if (etag_pos != std::string::npos) {
-            log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 304,
-                    "Cache hit (ETag)");
-            send_not_modified(fd, etag, last_modified);
+    if (cache.enabled() && static_cast<size_t>(st.st_size) <= CACHE_MAX_OBJECT_SIZE) {
+        std::shared_ptr<const CachedObject> object = load_object(file.get(), st, filename);
+        if (object) {
+            cache.insert(filename, object, cache_generation);
+            send_cached(res, request, filename, object, client_ip, client_port, is_head);
             return;
         }
     }
 
-    std::string extra =
-        "Last-Modified: " + last_modified + "\r\n" +
-        "ETag: " + etag + "\r\n" +
-        "Cache-Control: public, max-age=31536000, immutable";
-
-    std::string header = "HTTP/1.1 200 OK\r\n";
-    header += CORS_HEADERS;
-    header += "Content-Type: " + content_type + "\r\n";
-    header += "Content-Length: " + std::to_string(st.st_size) + "\r\n";
-    header += extra + "\r\n";
-    header += "Connection: close\r\n\r\n";
+    std::string last_modified = format_http_date(st.st_mtime);
+    std::string etag = generate_etag(st);
+    std::string content_type = get_content_type(filename);
 
-    if (send(fd, header.data(), header.size(), 0) < 0) {
-        log_msg(LogLevel::ERROR, client_ip, client_port, is_head ? "HEAD" : "GET", filename, 500,
-                "Failed to send headers: " + std::string(strerror(errno)));
+    if (!is_head && matches_if_none_match(request, etag)) {
+        log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 304,
+                "Cache hit (ETag)");
+        send_not_modified(res, etag, last_modified);
         return;
     }
 
+    res.data = build_retrieve_header(content_type, st.st_size, etag, last_modified) +
+               connection_header(res) + "\r\n";
+    res.data_sent = 0;
+
     if (is_head) {
         log_msg(LogLevel::INFO, client_ip, client_port, "HEAD", filename, 200,
                 "Metadata sent from serve directory");
         return;
     }
 
-    std::ifstream f(filepath, std::ios::binary);
-    if (!f) {
-        log_msg(LogLevel::ERROR, client_ip, client_port, "GET", filename, 500,
-                "Failed to open file: " + std::string(strerror(errno)));
+    res.file = std::move(file);
+    res.file_offset = 0;
+    res.file_remaining = static_cast<size_t>(st.st_size);
+
+    log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 200,
+            "Sending " + std::to_string(st.st_size) + " bytes from serve directory");
+}
+
+void handle_retrieve_original(Response& res, const std::string& filename,
+                              const std::string& original_path,
+                              ScopedFileDescriptor file, const struct stat& st,
+                              const std::string& client_ip, int client_port, bool is_head) {
+    const char* method = is_head ? "HEAD" : "GET";
+    if (!file) {
+        log_msg(LogLevel::INFO, client_ip, client_port, method, filename, 404,
+                "Original of pending WebP not found");
+        send_error(res, 404, "File not found");
         return;
     }
 
-    std::vector<char> buffer(BUFFER_SIZE);
-    size_t total_sent = 0;
-
-    while (f.good()) {
-        f.read(buffer.data(), buffer.size());
-        std::streamsize n = f.gcount();
+    // The WebP's ETag is only mtime and size, which the original can share;
+    // marking this one and adding the inode keeps a client from confusing
+    // the two.
+    std::string etag = generate_etag(st);
+    etag.insert(1, "orig-" + std::to_string(st.st_ino) + "-");
+    std::string cache_control = "public, max-age=" + std::to_string(PENDING_MAX_AGE);
+    res.data = build_retrieve_header(get_content_type(original_path), st.st_size,
+                                     etag, format_http_date(st.st_mtime),
+                                     cache_control) +
+               connection_header(res) + "\r\n";
+    res.data_sent = 0;
 
-        if (n > 0) {
-            ssize_t sent = send(fd, buffer.data(), n, 0);
-            if (sent < 0) {
-                log_msg(LogLevel::ERROR, client_ip, client_port, "GET", filename, 500,
-                        "Failed to send data at offset " + std::to_string(total_sent) +
-                        ": " + std::string(strerror(errno)));
-                break;
-            }
-            total_sent += sent;
-        }
+    if (is_head) {
+        log_msg(LogLevel::INFO, client_ip, client_port, method, filename, 200,
+                "WebP pending, metadata of original sent");
+        return;
     }
 
-    log_msg(LogLevel::INFO, client_ip, client_port, "GET", filename, 200,
-            "Sent " + std::to_string(total_sent) + " bytes from serve directory");
-}
+    res.file = std::move(file);
+    res.file_offset = 0;
+    res.file_remaining = static_cast<size_t>(st.st_size);
 
-void handle_upload(int fd, const std::string& request, const std::string& body,
-                   size_t body_len, const std::string& client_ip, int client_port) {
-    (void)request;
+    log_msg(LogLevel::INFO, client_ip, client_port, method, filename, 200,
+            "WebP pending, sending " + std::to_string(st.st_size) + " bytes of original");
+}
 
-    if (body_len > MAX_FILE_SIZE) {
+bool begin_upload(Response& res, Upload& upload, const HttpRequest& request,
+                  size_t content_length, const std::string& client_ip, int client_port) {
+    if (content_length > MAX_FILE_SIZE) {
         log_msg(LogLevel::WARN, client_ip, client_port, "POST", "/upload", 413,
-                "File too large: " + std::to_string(body_len) +
+                "File too large: " + std::to_string(content_length) +
                 " bytes (max: " + std::to_string(MAX_FILE_SIZE) + ")");
-        send_error(fd, 413, "File too large");
-        return;
+        send_error(res, 413, "File too large");
+        return false;
     }
 
-    std::string uuid = generate_sha256_uuid();
-
-    auto content_type_pos = request.find("Content-Type:");
     std::string content_type = "application/octet-stream";
-    if (content_type_pos != std::string::npos) {
-        size_t end_pos = request.find("\r\n", content_type_pos);
-        if (end_pos != std::string::npos) {
-            content_type = request.substr(content_type_pos + 14, end_pos - content_type_pos - 14);
-            auto trim_pos = content_type.find(';');
-            if (trim_pos != std::string::npos) {
-                content_type = content_type.substr(0, trim_pos);
-            }
+    if (const HttpHeader* header = request.find("Content-Type")) {
+        std::string_view value = header->value.substr(0, header->value.find(';'));
+        while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+            value.remove_suffix(1);
+        }
+        content_type = value;
+        std::transform(content_type.begin(), content_type.end(), content_type.begin(),
+                       [](unsigned char c) { return static_cast<char>(tolower(c)); });
+    }
+
+    // In lazy mode nothing is queued until the WebP is first requested.
+    bool eager = config().compress_mode == CompressMode::EAGER;
+    if (eager) {
+        upload.slot = CompressionSlot::acquire();
+    }
+    if (eager && !upload.slot) {
+        log_msg(LogLevel::WARN, client_ip, client_port, "POST", "/upload", 503,
+                "Compression queue full");
+        send_error(res, 503, "Compression queue full, retry later", "Retry-After: 5");
+        return false;
+    }
+
+    // Backfills ask to yield to interactive uploads: ?priority=bulk or
+    // "X-Priority: bulk".
+    std::string priority;
+    if (!get_query_param(request.query, "priority", priority)) {
+        if (const HttpHeader* header = request.find("X-Priority")) {
+            priority = header->value;
         }
     }
+    if (priority == "bulk") {
+        upload.priority = JobPriority::BULK;
+    }
+
+    upload.uuid = generate_sha256_uuid();
+    upload.extension = detect_extension_from_content_type(content_type);
+    upload.hashing = config().dedup;
+
+    std::string temppath = build_save_path(upload.uuid + ".tmp");
+    if (!upload.sink.open(temppath)) {
+        log_msg(LogLevel::ERROR, client_ip, client_port, "POST", "/upload", 500,
+                "Failed to create file: " + std::string(strerror(upload.sink.error())));
+        send_error(res, 500, "Failed to create file");
+        return false;
+    }
 
-    std::string ext = detect_extension_from_content_type(content_type);
+    return true;
+}
+
+void handle_upload(Response& res, Upload& upload,
+                   const std::string& client_ip, int client_port) {
+    if (upload.sink.failed()) {
+        log_msg(LogLevel::ERROR, client_ip, client_port, "POST", "/upload", 500,
+                "Write failed: " + std::string(strerror(upload.sink.error())));
+        send_error(res, 500, "Write failed");
+        return;
+    }
+
+    std::string ext = upload.extension;
     if (ext == ".bin") {
-        ext = detect_extension_from_magic(body);
+        ext = detect_extension_from_magic(upload.sink.prefix());
     }
 
-    std::string original_filename = uuid + ext;
-    std::string webp_filename = uuid + ".webp";
+    // With --dedup the name is the content digest, so an identical body maps
+    // to the same files; the random uuid then only names the temporary file.
+    std::string name = upload.hashing ? upload.digest.hex_digest() : upload.uuid;
+    std::string original_filename = name + ext;
+    std::string webp_filename = name + ".webp";
 
     std::string filepath = build_save_path(original_filename);
-    std::string temppath = filepath + ".tmp";
-
-    {
-        std::ofstream f(temppath, std::ios::binary);
-        if (!f) {
-            log_msg(LogLevel::ERROR, client_ip, client_port, "POST", "/upload", 500,
-                    "Failed to create file: " + std::string(strerror(errno)));
-            send_error(fd, 500, "Failed to create file");
-            return;
-        }
+    std::string webp_path = std::string(SERVE_DIR) + "/" + webp_filename;
+    std::string response_body = "{\"name\":\"" + webp_filename + "\"}";
 
-        f.write(body.data(), body_len);
-        if (!f) {
+    // A digest-named original is committed exclusively, so of two identical
+    // uploads racing here exactly one stores it; the other finds EEXIST.
+    bool webp_exists = upload.hashing && access(webp_path.c_str(), F_OK) == 0;
+    bool duplicate = webp_exists;
+    if (!duplicate && !upload.sink.commit(filepath, !upload.hashing)) {
+        duplicate = upload.hashing && upload.sink.error() == EEXIST;
+        if (!duplicate) {
             log_msg(LogLevel::ERROR, client_ip, client_port, "POST", "/upload", 500,
-                    "Write failed");
-            unlink(temppath.c_str());
-            send_error(fd, 500, "Write failed");
+                    "Failed to rename file: " + std::string(strerror(upload.sink.error())));
+            send_error(res, 500, "Failed to save file");
             return;
         }
     }
 
-    if (rename(temppath.c_str(), filepath.c_str()) != 0) {
-        log_msg(LogLevel::ERROR, client_ip, client_port, "POST", "/upload", 500,
-                "Failed to rename file: " + std::string(strerror(errno)));
-        unlink(temppath.c_str());
-        send_error(fd, 500, "Failed to save file");
+    // The sink removes the temporary file. Without a WebP the original's job
+    // is pending, or it failed or was lost; submitting again is a no-op for a
+    // pending name and otherwise retries it, so the name does not 404 for
+    // good. An unused slot is released.
+    if (duplicate) {
+        bool requeued = !webp_exists && upload.slot;
+        if (requeued) {
+            upload.slot.submit(filepath, webp_path, upload.priority, upload.sink.size());
+        }
+        log_msg(LogLevel::INFO, client_ip, client_port, "POST", "/upload", 200,
+                "Duplicate upload of " + std::to_string(upload.sink.size()) +
+                " bytes, reusing " + webp_filename +
+                (requeued ? " (WebP missing, compression requested)" : ""));
+        send_response(res, 200, "OK", "application/json", "", response_body);
         return;
     }
 
     chmod(filepath.c_str(), 0600);
 
-    std::string webp_path = std::string(SERVE_DIR) + "/" + webp_filename;
-    compress_to_webp_background(filepath, webp_path);
-
-    log_msg(LogLevel::INFO, client_ip, client_port, "POST", "/upload", 200,
-            "Uploaded " + std::to_string(body_len) +
-            " bytes as " + original_filename + ", compressing to " + webp_filename);
+    if (upload.slot) {
+        upload.slot.submit(filepath, webp_path, upload.priority, upload.sink.size());
+        log_msg(LogLevel::INFO, client_ip, client_port, "POST", "/upload", 200,
+                "Uploaded " + std::to_string(upload.sink.size()) +
+                " bytes as " + original_filename + ", compressing to " + webp_filename +
+                (upload.priority == JobPriority::BULK ? " (bulk)" : ""));
+    } else {
+        log_msg(LogLevel::INFO, client_ip, client_port, "POST", "/upload", 200,
+                "Uploaded " + std::to_string(upload.sink.size()) +
+                " bytes as " + original_filename + ", " + webp_filename +
+                " encoded on first request");
+    }
 
-    std::string response_body = "{\"name\":\"" + webp_filename + "\"}";
-    send_response(fd, 200, "OK", "application/json", "", response_body);
+    send_response(res, 200, "OK", "application/json", "", response_body);
 }
 
 }
@@ -1,18 +1,67 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include "http_response.hpp"
+#include "http_request.hpp"
+#include "compression.hpp"
+#include "upload_sink.hpp"
+#include "sha256.hpp"
 #include <string>
+#include <cstdint>
+#include <sys/stat.h>
 
 namespace ImageCurry {
 
 constexpr size_t MAX_FILE_SIZE = 128 * 1024 * 1024;
 constexpr int BUFFER_SIZE = 8192;
+constexpr int PENDING_MAX_AGE = 10;     // Cache-Control for an original served in place of its WebP
 
-void handle_options(int fd, const std::string& client_ip, int client_port);
-void handle_retrieve(int fd, const std::string& request, const std::string& filename,
-                     const std::string& client_ip, int client_port, bool is_head);
-void handle_upload(int fd, const std::string& request, const std::string& body,
-                   size_t body_len, const std::string& client_ip, int client_port);
+void handle_options(Response& res, const std::string& client_ip, int client_port);
+// GET/HEAD /retrieve is served in two steps so the I/O engine can open the
+// file however suits it: handle_retrieve_cached() answers from the object
+// cache and returns false on a miss, after which the engine opens
+// build_serve_path(filename) and passes the result (an invalid descriptor if
+// the open or stat failed) to handle_retrieve_file(). cache_generation
+// carries the cache state seen on the miss so a file replaced in between is
+// not cached.
+bool handle_retrieve_cached(Response& res, const HttpRequest& request,
+                            const std::string& filename,
+                            const std::string& client_ip, int client_port, bool is_head,
+                            uint64_t& cache_generation);
+void handle_retrieve_file(Response& res, const HttpRequest& request, const std::string& filename,
+                          ScopedFileDescriptor file, const struct stat& st,
+                          uint64_t cache_generation,
+                          const std::string& client_ip, int client_port, bool is_head);
+// Answers a request for a WebP that is still being encoded with the upload
+// it is encoded from (--pending=original). The original's own Content-Type
+// is sent with a short max-age, and it is never cached or validated.
+void handle_retrieve_original(Response& res, const std::string& filename,
+                              const std::string& original_path,
+                              ScopedFileDescriptor file, const struct stat& st,
+                              const std::string& client_ip, int client_port, bool is_head);
+// Per-request upload state, created once the headers of a POST /upload are
+// parsed and fed body bytes by the connection as they arrive.
+struct Upload {
+    std::string uuid;
+    std::string extension;      // from Content-Type; ".bin" means sniff the body
+    CompressionSlot slot;
+    UploadSink sink;
+    bool hashing = false;       // --dedup: the name comes from digest
+    JobPriority priority = JobPriority::INTERACTIVE;
+    Sha256 digest;
+
+    void write(const char* data, size_t len) {
+        sink.write(data, len);
+        if (hashing) {
+            digest.update(data, len);
+        }
+    }
+};
+
+bool begin_upload(Response& res, Upload& upload, const HttpRequest& request,
+                  size_t content_length, const std::string& client_ip, int client_port);
+void handle_upload(Response& res, Upload& upload,
+                   const std::string& client_ip, int client_port);
 
 }
 #endif
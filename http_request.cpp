@@ -0,0 +1,233 @@
+#include "http_request.hpp"
+#include <cctype>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGECURRY_X86_SCAN 1
+#endif
+
+namespace ImageCurry {
+
+// Delimiter search for the parser. The widest scanner the CPU supports is
+// picked once at startup; each returns end when c does not occur.
+using FindByteFn = const char* (*)(const char* p, const char* end, char c);
+
+static const char* find_byte_scalar(const char* p, const char* end, char c) {
+    for (; p < end; p++) {
+        if (*p == c) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef IMAGECURRY_X86_SCAN
+__attribute__((target("sse2")))
+static const char* find_byte_sse2(const char* p, const char* end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* find_byte_avx2(const char* p, const char* end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = static_cast<unsigned>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_byte_sse2(p, end, c);
+}
+#endif
+
+static FindByteFn select_find_byte(const char*& name) {
+#ifdef IMAGECURRY_X86_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return find_byte_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        name = "sse2";
+        return find_byte_sse2;
+    }
+#endif
+    name = "scalar";
+    return find_byte_scalar;
+}
+
+static const char* scanner_name = "scalar";
+static const FindByteFn find_byte_impl = select_find_byte(scanner_name);
+
+static size_t find_byte(std::string_view s, size_t from, char c) {
+    const char* end = s.data() + s.size();
+    const char* hit = find_byte_impl(s.data() + from, end, c);
+    return hit == end ? std::string_view::npos : static_cast<size_t>(hit - s.data());
+}
+
+const char* header_scanner() {
+    return scanner_name;
+}
+
+static char lower(char c) {
+    return static_cast<char>(tolower(static_cast<unsigned char>(c)));
+}
+
+static std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool header_has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        if (iequals(trim(value.substr(0, comma)), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+const HttpHeader* HttpRequest::find(std::string_view name) const {
+    for (size_t i = 0; i < header_count; i++) {
+        if (iequals(headers[i].name, name)) {
+            return &headers[i];
+        }
+    }
+    return nullptr;
+}
+
+std::string_view HttpRequest::header(std::string_view name) const {
+    const HttpHeader* h = find(name);
+    return h ? h->value : std::string_view();
+}
+
+void RequestParser::reset() {
+    state_ = State::REQUEST_LINE;
+    line_start_ = 0;
+    scan_pos_ = 0;
+    error_ = "";
+}
+
+ParseStatus RequestParser::parse(std::string_view buffer, HttpRequest& request) {
+    if (state_ == State::REQUEST_LINE && line_start_ == 0) {
+        request = HttpRequest();
+    }
+
+    while (state_ != State::DONE) {
+        size_t line_end = find_byte(buffer, scan_pos_, '\n');
+        if (line_end == std::string_view::npos) {
+            scan_pos_ = buffer.size();
+            return ParseStatus::INCOMPLETE;
+        }
+
+        std::string_view line = buffer.substr(line_start_, line_end - line_start_);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        line_start_ = line_end + 1;
+        scan_pos_ = line_start_;
+
+        if (state_ == State::REQUEST_LINE) {
+            // Tolerate blank lines before the request line (RFC 9112 2.2).
+            if (line.empty()) {
+                continue;
+            }
+            if (!parse_request_line(line, request)) {
+                return ParseStatus::FAILED;
+            }
+            state_ = State::HEADERS;
+        } else if (line.empty()) {
+            state_ = State::DONE;
+        } else if (!parse_header_line(line, request)) {
+            return ParseStatus::FAILED;
+        }
+    }
+
+    return ParseStatus::COMPLETE;
+}
+
+bool RequestParser::parse_request_line(std::string_view line, HttpRequest& request) {
+    size_t first_space = line.find(' ');
+    size_t second_space = (first_space == std::string_view::npos)
+                              ? std::string_view::npos
+                              : line.find(' ', first_space + 1);
+    if (first_space == 0 || second_space == std::string_view::npos ||
+        second_space == first_space + 1 || second_space + 1 >= line.size()) {
+        error_ = "Malformed request";
+        return false;
+    }
+
+    request.method = line.substr(0, first_space);
+    request.target = line.substr(first_space + 1, second_space - first_space - 1);
+    request.version = line.substr(second_space + 1);
+
+    if (request.version.find(' ') != std::string_view::npos) {
+        error_ = "Malformed request";
+        return false;
+    }
+
+    size_t query_pos = request.target.find('?');
+    request.path = request.target.substr(0, query_pos);
+    request.query = (query_pos == std::string_view::npos)
+                        ? std::string_view()
+                        : request.target.substr(query_pos + 1);
+    return true;
+}
+
+bool RequestParser::parse_header_line(std::string_view line, HttpRequest& request) {
+    // Obsolete line folding is rejected rather than unfolded (RFC 9112 5.2).
+    if (line.front() == ' ' || line.front() == '\t') {
+        error_ = "Malformed header";
+        return false;
+    }
+
+    size_t colon = find_byte(line, 0, ':');
+    if (colon == std::string_view::npos || colon == 0) {
+        error_ = "Malformed header";
+        return false;
+    }
+
+    std::string_view name = line.substr(0, colon);
+    if (name.back() == ' ' || name.back() == '\t') {
+        error_ = "Malformed header";
+        return false;
+    }
+
+    if (request.header_count == MAX_HEADERS) {
+        error_ = "Too many headers";
+        return false;
+    }
+
+    request.headers[request.header_count++] = {name, trim(line.substr(colon + 1))};
+    return true;
+}
+
+}
@@ -0,0 +1,74 @@
+#ifndef HTTP_REQUEST_H
+#define HTTP_REQUEST_H
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+namespace ImageCurry {
+
+constexpr size_t MAX_HEADERS = 64;
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;         // leading/trailing whitespace removed
+};
+
+// A parsed request head. Every view points into the buffer given to
+// RequestParser::parse() and is only valid while that buffer is unchanged.
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;        // as sent, e.g. /retrieve?name=x.webp
+    std::string_view path;          // target up to '?'
+    std::string_view query;         // target after '?', empty if none
+    std::string_view version;
+
+    HttpHeader headers[MAX_HEADERS];
+    size_t header_count = 0;
+
+    // Case-insensitive lookup of the first header with this name.
+    const HttpHeader* find(std::string_view name) const;
+    std::string_view header(std::string_view name) const;
+    bool has_header(std::string_view name) const { return find(name) != nullptr; }
+};
+
+enum class ParseStatus {
+    INCOMPLETE,     // need more bytes
+    COMPLETE,       // head parsed; consumed() bytes belong to it
+    FAILED          // malformed; error() says why
+};
+
+// Resumable request-head parser. Call parse() each time bytes are appended
+// to the buffer; lines already tokenized are not scanned again, and a search
+// for the end of a partial line resumes where the previous call stopped.
+// Line ends and header colons are located 16 or 32 bytes at a time with
+// SSE2/AVX2 when the CPU has them.
+class RequestParser {
+public:
+    ParseStatus parse(std::string_view buffer, HttpRequest& request);
+    void reset();
+
+    size_t consumed() const { return line_start_; }
+    const char* error() const { return error_; }
+
+private:
+    enum class State { REQUEST_LINE, HEADERS, DONE };
+
+    bool parse_request_line(std::string_view line, HttpRequest& request);
+    bool parse_header_line(std::string_view line, HttpRequest& request);
+
+    State state_ = State::REQUEST_LINE;
+    size_t line_start_ = 0;         // first byte of the line being parsed
+    size_t scan_pos_ = 0;           // where the search for '\n' resumes
+    const char* error_ = "";
+};
+
+// Name of the delimiter scanner chosen for this CPU: "avx2", "sse2" or "scalar".
+const char* header_scanner();
+
+bool iequals(std::string_view a, std::string_view b);
+// True if the comma-separated header value contains token (case-insensitive).
+bool header_has_token(std::string_view value, std::string_view token);
+
+}
+#endif
@@ -1,18 +1,25 @@
 #include "http_response.hpp"
-#include <unistd.h>
-#include <sys/socket.h>
+#include "config.hpp"
 
 namespace ImageCurry {
 
 constexpr const char* CORS_HEADERS =
     "Access-Control-Allow-Origin: *\r\n"
     "Access-Control-Allow-Methods: GET, POST, HEAD, OPTIONS\r\n"
-    "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization\r\n"
+    "Access-Control-Allow-Headers: Content-Type, Content-Length, If-None-Match, If-Modified-Since, Authorization, X-Priority\r\n"
     "Access-Control-Expose-Headers: Content-Length, Content-Type\r\n"
     "Access-Control-Max-Age: 86400\r\n"
     "Vary: Origin\r\n";
 
-void send_response(int fd, int code, const std::string& status,
+std::string connection_header(const Response& res) {
+    if (!res.keep_alive) {
+        return "Connection: close\r\n";
+    }
+    return "Connection: keep-alive\r\n"
+           "Keep-Alive: timeout=" + std::to_string(config().keepalive_timeout) + "\r\n";
+}
+
+void send_response(Response& res, int code, const std::string& status,
                    const std::string& content_type,
                    const std::string& extra_headers,
                    const std::string& body) {
@@ -25,39 +32,46 @@ void send_response(int fd, int code, const std::string& status,
         header += extra_headers + "\r\n";
     }
 
-    header += "Connection: close\r\n\r\n";
-
-    send(fd, header.data(), header.size(), 0);
+    header += connection_header(res) + "\r\n";
 
-    if (!body.empty()) {
-        send(fd, body.data(), body.size(), 0);
-    }
+    res.data = std::move(header);
+    res.data += body;
+    res.data_sent = 0;
 }
 
-void send_error(int fd, int code, const std::string& message) {
+void send_error(Response& res, int code, const std::string& message,
+                const std::string& extra_headers) {
     std::string status;
     switch (code) {
         case 400: status = "Bad Request"; break;
         case 404: status = "Not Found"; break;
         case 413: status = "Payload Too Large"; break;
+        case 415: status = "Unsupported Media Type"; break;
+        case 417: status = "Expectation Failed"; break;
         case 500: status = "Internal Server Error"; break;
         case 501: status = "Not Implemented"; break;
+        case 503: status = "Service Unavailable"; break;
         default: status = "Error"; break;
     }
 
     std::string body = "<html><body><h1>" + std::to_string(code) + " " +
                        status + "</h1><p>" + message + "</p></body></html>";
 
-    send_response(fd, code, status, "text/html", "", body);
+    send_response(res, code, status, "text/html", extra_headers, body);
 }
 
-void send_not_modified(int fd, const std::string& etag,
+void send_not_modified(Response& res, const std::string& etag,
                        const std::string& last_modified) {
     std::string extra = "ETag: " + etag + "\r\n" +
                         "Last-Modified: " + last_modified + "\r\n" +
                         "Cache-Control: public, max-age=31536000, immutable";
 
-    send_response(fd, 304, "Not Modified", "text/plain", extra, "");
+    send_response(res, 304, "Not Modified", "text/plain", extra, "");
+}
+
+void send_continue(Response& res) {
+    res.data = "HTTP/1.1 100 Continue\r\n\r\n";
+    res.data_sent = 0;
 }
 
 }
@@ -1,17 +1,45 @@
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
 
+#include "utils.hpp"
 #include <string>
+#include <memory>
 #include <cstddef>
+#include <sys/types.h>
 
 namespace ImageCurry {
 
-void send_response(int fd, int code, const std::string& status,
+struct Response {
+    std::string data;
+    size_t data_sent = 0;
+    bool keep_alive = false;
+
+    ScopedFileDescriptor file;
+    off_t file_offset = 0;
+    size_t file_remaining = 0;
+
+    // In-memory body (shared with the object cache), sent right after data.
+    std::shared_ptr<const std::string> body;
+    size_t body_sent = 0;
+
+    size_t body_remaining() const { return body ? body->size() - body_sent : 0; }
+    bool ready() const { return !data.empty(); }
+    bool complete() const {
+        return data_sent >= data.size() && body_remaining() == 0 && file_remaining == 0;
+    }
+};
+
+std::string connection_header(const Response& res);
+void send_response(Response& res, int code, const std::string& status,
                    const std::string& content_type,
                    const std::string& extra_headers,
                    const std::string& body);
-void send_error(int fd, int code, const std::string& message);
-void send_not_modified(int fd, const std::string& etag,
+void send_error(Response& res, int code, const std::string& message,
+                const std::string& extra_headers = "");
+// Interim response to Expect: 100-continue; the final response follows later
+// on the same connection.
+void send_continue(Response& res);
+void send_not_modified(Response& res, const std::string& etag,
                        const std::string& last_modified);
 
 }
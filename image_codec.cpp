@@ -0,0 +1,648 @@
+#include "image_codec.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+
+#ifdef IMAGECURRY_WITH_WEBP
+#include <webp/encode.h>
+#include <webp/decode.h>
+#endif
+#ifdef IMAGECURRY_WITH_JPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+#ifdef IMAGECURRY_WITH_PNG
+#include <png.h>
+#endif
+#ifdef IMAGECURRY_WITH_GIF
+#include <gif_lib.h>
+#endif
+
+namespace ImageCurry {
+
+static void fit_within(int width, int height, int max_width, int max_height,
+                       int& out_width, int& out_height) {
+    if (width <= max_width && height <= max_height) {
+        out_width = width;
+        out_height = height;
+        return;
+    }
+
+    double scale = std::min(static_cast<double>(max_width) / width,
+                            static_cast<double>(max_height) / height);
+    out_width = std::max(1, static_cast<int>(std::lround(width * scale)));
+    out_height = std::max(1, static_cast<int>(std::lround(height * scale)));
+}
+
+struct Contribution {
+    int start;
+    std::vector<float> weights;
+};
+
+// Box-filter weights for shrinking src samples onto dst samples: each output
+// sample averages the source samples it covers, weighted by overlap.
+static std::vector<Contribution> box_contributions(int src, int dst) {
+    std::vector<Contribution> contributions(dst);
+    double scale = static_cast<double>(src) / dst;
+
+    for (int i = 0; i < dst; i++) {
+        double lo = i * scale;
+        double hi = (i + 1) * scale;
+        int first = static_cast<int>(std::floor(lo));
+        int last = std::min(src, static_cast<int>(std::ceil(hi)));
+
+        Contribution& c = contributions[i];
+        c.start = first;
+        for (int s = first; s < last; s++) {
+            double overlap = std::min(hi, s + 1.0) - std::max(lo, static_cast<double>(s));
+            c.weights.push_back(static_cast<float>(overlap / scale));
+        }
+    }
+    return contributions;
+}
+
+void resize_to_fit(Image& image, int max_width, int max_height) {
+    int dst_w, dst_h;
+    fit_within(image.width, image.height, max_width, max_height, dst_w, dst_h);
+    if (dst_w == image.width && dst_h == image.height) {
+        return;
+    }
+
+    const int ch = image.channels;
+    const int src_w = image.width;
+    const int src_h = image.height;
+
+    auto cols = box_contributions(src_w, dst_w);
+    auto rows = box_contributions(src_h, dst_h);
+
+    std::vector<float> horizontal(static_cast<size_t>(dst_w) * src_h * ch);
+    for (int y = 0; y < src_h; y++) {
+        const uint8_t* src_row = &image.pixels[static_cast<size_t>(y) * src_w * ch];
+        float* dst_row = &horizontal[static_cast<size_t>(y) * dst_w * ch];
+        for (int x = 0; x < dst_w; x++) {
+            const Contribution& c = cols[x];
+            for (int k = 0; k < ch; k++) {
+                float sum = 0.0f;
+                for (size_t i = 0; i < c.weights.size(); i++) {
+                    sum += c.weights[i] * src_row[(c.start + i) * ch + k];
+                }
+                dst_row[x * ch + k] = sum;
+            }
+        }
+    }
+
+    std::vector<uint8_t> out(static_cast<size_t>(dst_w) * dst_h * ch);
+    for (int y = 0; y < dst_h; y++) {
+        const Contribution& c = rows[y];
+        uint8_t* dst_row = &out[static_cast<size_t>(y) * dst_w * ch];
+        for (int x = 0; x < dst_w * ch; x++) {
+            float sum = 0.0f;
+            for (size_t i = 0; i < c.weights.size(); i++) {
+                sum += c.weights[i] * horizontal[(c.start + i) * dst_w * ch + x];
+            }
+            dst_row[x] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, sum + 0.5f)));
+        }
+    }
+
+    image.width = dst_w;
+    image.height = dst_h;
+    image.pixels.swap(out);
+}
+
+// Trims the longer dimension, keeping the centre, so the image has the
+// aspect ratio of width x height.
+static void crop_to_aspect(Image& image, int width, int height) {
+    int crop_w = image.width;
+    int crop_h = image.height;
+    if (static_cast<int64_t>(image.width) * height > static_cast<int64_t>(image.height) * width) {
+        crop_w = std::max(1, static_cast<int>(static_cast<int64_t>(image.height) * width / height));
+    } else {
+        crop_h = std::max(1, static_cast<int>(static_cast<int64_t>(image.width) * height / width));
+    }
+    if (crop_w == image.width && crop_h == image.height) {
+        return;
+    }
+
+    const size_t ch = image.channels;
+    const int left = (image.width - crop_w) / 2;
+    const int top = (image.height - crop_h) / 2;
+    std::vector<uint8_t> out(static_cast<size_t>(crop_w) * crop_h * ch);
+    for (int y = 0; y < crop_h; y++) {
+        const uint8_t* src = &image.pixels[(static_cast<size_t>(top + y) * image.width + left) * ch];
+        std::copy(src, src + crop_w * ch, &out[static_cast<size_t>(y) * crop_w * ch]);
+    }
+
+    image.width = crop_w;
+    image.height = crop_h;
+    image.pixels.swap(out);
+}
+
+#ifdef IMAGECURRY_WITH_WEBP
+
+bool native_encoder_available() {
+    return true;
+}
+
+static bool within_decode_limits(int64_t width, int64_t height) {
+    return width > 0 && height > 0 &&
+           width <= DECODE_MAX_DIMENSION && height <= DECODE_MAX_DIMENSION &&
+           width * height <= DECODE_MAX_PIXELS;
+}
+
+static std::string decode_limit_error(int64_t width, int64_t height) {
+    return "Image dimensions " + std::to_string(width) + "x" + std::to_string(height) +
+           " exceed the decode limit";
+}
+
+static bool read_file(const std::string& path, std::string& data) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) return false;
+    data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    return !f.bad();
+}
+
+static CodecResult decode_webp(const std::string& path, Image& image, std::string& error) {
+    std::string data;
+    if (!read_file(path, data)) {
+        error = "Failed to read " + path;
+        return CodecResult::FAILED;
+    }
+
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(bytes, data.size(), &features) != VP8_STATUS_OK) {
+        error = "Invalid WebP bitstream";
+        return CodecResult::FAILED;
+    }
+    if (!within_decode_limits(features.width, features.height)) {
+        error = decode_limit_error(features.width, features.height);
+        return CodecResult::FAILED;
+    }
+
+    int width = 0, height = 0;
+    uint8_t* decoded = features.has_alpha
+                           ? WebPDecodeRGBA(bytes, data.size(), &width, &height)
+                           : WebPDecodeRGB(bytes, data.size(), &width, &height);
+    if (!decoded) {
+        error = "WebP decode failed";
+        return CodecResult::FAILED;
+    }
+
+    image.width = width;
+    image.height = height;
+    image.channels = features.has_alpha ? 4 : 3;
+    image.pixels.assign(decoded, decoded + static_cast<size_t>(width) * height * image.channels);
+    WebPFree(decoded);
+    return CodecResult::OK;
+}
+
+#ifdef IMAGECURRY_WITH_JPEG
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorManager* err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+// Kept free of C++ objects with destructors between setjmp() and the
+// libjpeg calls that may longjmp() back here. The one C++ allocation, the
+// pixel buffer, is caught here so the decompress state is always destroyed;
+// the caller owns fp.
+static CodecResult decode_jpeg(FILE* fp, int fit_width, int fit_height,
+                               Image& image, char* error_message) {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    jerr.message[0] = '\0';
+
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        strncpy(error_message, jerr.message, JMSG_LENGTH_MAX);
+        return CodecResult::FAILED;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (!within_decode_limits(cinfo.image_width, cinfo.image_height)) {
+        snprintf(error_message, JMSG_LENGTH_MAX, "dimensions %ux%u exceed the decode limit",
+                 cinfo.image_width, cinfo.image_height);
+        jpeg_destroy_decompress(&cinfo);
+        return CodecResult::FAILED;
+    }
+
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&cinfo);
+        return CodecResult::UNSUPPORTED;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+
+    // Let the IDCT do most of the shrinking when the target is much smaller,
+    // but never drop below the final size so the resize still filters.
+    int target_w, target_h;
+    fit_within(cinfo.image_width, cinfo.image_height, fit_width, fit_height,
+               target_w, target_h);
+    unsigned int denom = 1;
+    while (denom < 8 &&
+           cinfo.image_width / (denom * 2) >= static_cast<unsigned int>(target_w) &&
+           cinfo.image_height / (denom * 2) >= static_cast<unsigned int>(target_h)) {
+        denom *= 2;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+
+    jpeg_start_decompress(&cinfo);
+
+    image.width = cinfo.output_width;
+    image.height = cinfo.output_height;
+    image.channels = 3;
+    try {
+        image.pixels.resize(static_cast<size_t>(image.width) * image.height * 3);
+    } catch (const std::bad_alloc&) {
+        jpeg_destroy_decompress(&cinfo);
+        snprintf(error_message, JMSG_LENGTH_MAX, "out of memory for %ux%u pixels",
+                 cinfo.output_width, cinfo.output_height);
+        return CodecResult::FAILED;
+    }
+
+    size_t stride = static_cast<size_t>(image.width) * 3;
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &image.pixels[cinfo.output_scanline * stride];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return CodecResult::OK;
+}
+#endif
+
+#ifdef IMAGECURRY_WITH_PNG
+static CodecResult decode_png(const std::string& path, Image& image, std::string& error) {
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_file(&png, path.c_str())) {
+        error = png.message;
+        return CodecResult::FAILED;
+    }
+    if (!within_decode_limits(png.width, png.height)) {
+        error = decode_limit_error(png.width, png.height);
+        png_image_free(&png);
+        return CodecResult::FAILED;
+    }
+
+    bool has_alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+    png.format = has_alpha ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+
+    image.width = png.width;
+    image.height = png.height;
+    image.channels = has_alpha ? 4 : 3;
+    try {
+        image.pixels.resize(PNG_IMAGE_SIZE(png));
+    } catch (const std::bad_alloc&) {
+        png_image_free(&png);
+        throw;
+    }
+
+    if (!png_image_finish_read(&png, nullptr, image.pixels.data(), 0, nullptr)) {
+        error = png.message;
+        png_image_free(&png);
+        return CodecResult::FAILED;
+    }
+
+    return CodecResult::OK;
+}
+#endif
+
+#ifdef IMAGECURRY_WITH_GIF
+static CodecResult decode_gif(const std::string& path, Image& image, std::string& error) {
+    int gif_error = 0;
+    GifFileType* gif = DGifOpenFileName(path.c_str(), &gif_error);
+    if (!gif) {
+        const char* message = GifErrorString(gif_error);
+        error = message ? message : "GIF open failed";
+        return CodecResult::FAILED;
+    }
+
+    // The logical screen size is known from the header; check it before
+    // DGifSlurp() allocates the frames.
+    if (!within_decode_limits(gif->SWidth, gif->SHeight)) {
+        error = decode_limit_error(gif->SWidth, gif->SHeight);
+        DGifCloseFile(gif, &gif_error);
+        return CodecResult::FAILED;
+    }
+
+    if (DGifSlurp(gif) != GIF_OK || gif->ImageCount < 1) {
+        const char* message = GifErrorString(gif->Error);
+        error = message ? message : "GIF decode failed";
+        DGifCloseFile(gif, &gif_error);
+        return CodecResult::FAILED;
+    }
+
+    // Like convert without a frame selector writing a single-frame format,
+    // only the first frame is kept; it is composited onto a transparent
+    // logical screen.
+    const SavedImage& frame = gif->SavedImages[0];
+    const GifImageDesc& desc = frame.ImageDesc;
+    const ColorMapObject* colors = desc.ColorMap ? desc.ColorMap : gif->SColorMap;
+    if (!colors) {
+        error = "GIF has no color map";
+        DGifCloseFile(gif, &gif_error);
+        return CodecResult::FAILED;
+    }
+
+    GraphicsControlBlock gcb;
+    gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+    DGifSavedExtensionToGCB(gif, 0, &gcb);
+
+    image.width = gif->SWidth;
+    image.height = gif->SHeight;
+    image.channels = 4;
+    try {
+        image.pixels.assign(static_cast<size_t>(image.width) * image.height * 4, 0);
+    } catch (const std::bad_alloc&) {
+        DGifCloseFile(gif, &gif_error);
+        throw;
+    }
+
+    for (int y = 0; y < desc.Height; y++) {
+        int canvas_y = desc.Top + y;
+        if (canvas_y < 0 || canvas_y >= image.height) continue;
+        for (int x = 0; x < desc.Width; x++) {
+            int canvas_x = desc.Left + x;
+            if (canvas_x < 0 || canvas_x >= image.width) continue;
+
+            int index = frame.RasterBits[y * desc.Width + x];
+            if (index == gcb.TransparentColor || index >= colors->ColorCount) continue;
+
+            uint8_t* px = &image.pixels[(static_cast<size_t>(canvas_y) * image.width + canvas_x) * 4];
+            px[0] = colors->Colors[index].Red;
+            px[1] = colors->Colors[index].Green;
+            px[2] = colors->Colors[index].Blue;
+            px[3] = 255;
+        }
+    }
+
+    DGifCloseFile(gif, &gif_error);
+    return CodecResult::OK;
+}
+#endif
+
+static CodecResult decode_by_type(const std::string& path, int fit_width, int fit_height,
+                                  Image& image, std::string& error) {
+    std::string magic(16, '\0');
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (!f) {
+            error = "Failed to open " + path;
+            return CodecResult::FAILED;
+        }
+        f.read(&magic[0], magic.size());
+        magic.resize(f.gcount());
+    }
+
+    std::string ext = detect_extension_from_magic(magic);
+#ifndef IMAGECURRY_WITH_JPEG
+    (void)fit_width;
+    (void)fit_height;
+#endif
+
+    if (ext == ".webp") {
+        return decode_webp(path, image, error);
+    }
+#ifdef IMAGECURRY_WITH_JPEG
+    if (ext == ".jpg") {
+        std::unique_ptr<FILE, int (*)(FILE*)> fp(fopen(path.c_str(), "rb"), fclose);
+        if (!fp) {
+            error = "Failed to open " + path;
+            return CodecResult::FAILED;
+        }
+        char message[JMSG_LENGTH_MAX] = {0};
+        CodecResult result = decode_jpeg(fp.get(), fit_width, fit_height, image, message);
+        if (result == CodecResult::FAILED) {
+            error = std::string("JPEG decode failed: ") + message;
+        }
+        return result;
+    }
+#endif
+#ifdef IMAGECURRY_WITH_PNG
+    if (ext == ".png") {
+        return decode_png(path, image, error);
+    }
+#endif
+#ifdef IMAGECURRY_WITH_GIF
+    if (ext == ".gif") {
+        return decode_gif(path, image, error);
+    }
+#endif
+
+    error = "No built-in decoder for " + ext + " input";
+    return CodecResult::UNSUPPORTED;
+}
+
+CodecResult decode_image(const std::string& path, int fit_width, int fit_height,
+                         Image& image, std::string& error) {
+    // The dimension limits keep honest inputs well within memory; this only
+    // stops an allocation that still fails from terminating the server.
+    try {
+        return decode_by_type(path, fit_width, fit_height, image, error);
+    } catch (const std::bad_alloc&) {
+        image.pixels.clear();
+        image.pixels.shrink_to_fit();
+        error = "Out of memory decoding " + path;
+        return CodecResult::FAILED;
+    }
+}
+
+CodecResult encode_webp(const Image& image, float quality, int method,
+                        std::string& out, std::string& error) {
+    WebPConfig webp_config;
+    if (!WebPConfigInit(&webp_config)) {
+        error = "WebP library version mismatch";
+        return CodecResult::FAILED;
+    }
+    webp_config.quality = quality;
+    webp_config.method = method;
+    if (!WebPValidateConfig(&webp_config)) {
+        error = "Invalid WebP configuration";
+        return CodecResult::FAILED;
+    }
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture)) {
+        error = "WebP library version mismatch";
+        return CodecResult::FAILED;
+    }
+    picture.width = image.width;
+    picture.height = image.height;
+
+    int imported = (image.channels == 4)
+                       ? WebPPictureImportRGBA(&picture, image.pixels.data(), image.width * 4)
+                       : WebPPictureImportRGB(&picture, image.pixels.data(), image.width * 3);
+    if (!imported) {
+        error = "Failed to import pixels into WebP picture";
+        WebPPictureFree(&picture);
+        return CodecResult::FAILED;
+    }
+
+    WebPMemoryWriter writer;
+    WebPMemoryWriterInit(&writer);
+    picture.writer = WebPMemoryWrite;
+    picture.custom_ptr = &writer;
+
+    bool ok = WebPEncode(&webp_config, &picture) != 0;
+    if (ok) {
+        out.assign(reinterpret_cast<const char*>(writer.mem), writer.size);
+    } else {
+        error = "WebP encode failed (error " +
+                std::to_string(static_cast<int>(picture.error_code)) + ")";
+    }
+
+    WebPMemoryWriterClear(&writer);
+    WebPPictureFree(&picture);
+    return ok ? CodecResult::OK : CodecResult::FAILED;
+}
+
+#else
+
+bool native_encoder_available() {
+    return false;
+}
+
+CodecResult decode_image(const std::string& path, int fit_width, int fit_height,
+                         Image& image, std::string& error) {
+    (void)path;
+    (void)fit_width;
+    (void)fit_height;
+    (void)image;
+    error = "Built without libwebp";
+    return CodecResult::UNSUPPORTED;
+}
+
+CodecResult encode_webp(const Image& image, float quality, int method,
+                        std::string& out, std::string& error) {
+    (void)image;
+    (void)quality;
+    (void)method;
+    (void)out;
+    error = "Built without libwebp";
+    return CodecResult::UNSUPPORTED;
+}
+
+#endif
+
+static CodecResult write_atomically(const std::string& output_path, const std::string& encoded,
+                                    std::string& error) {
+    std::string temp_path = output_path + ".tmp";
+    {
+        std::ofstream f(temp_path, std::ios::binary | std::ios::trunc);
+        if (!f) {
+            error = "Failed to create " + temp_path + ": " + strerror(errno);
+            return CodecResult::FAILED;
+        }
+        f.write(encoded.data(), encoded.size());
+        if (!f) {
+            error = "Failed to write " + temp_path;
+            f.close();
+            unlink(temp_path.c_str());
+            return CodecResult::FAILED;
+        }
+    }
+
+    if (rename(temp_path.c_str(), output_path.c_str()) != 0) {
+        error = "Failed to rename " + temp_path + ": " + strerror(errno);
+        unlink(temp_path.c_str());
+        return CodecResult::FAILED;
+    }
+
+    return CodecResult::OK;
+}
+
+CodecResult convert_to_webp(const std::string& input_path,
+                            const std::vector<WebpOutput>& outputs, std::string& error) {
+    int largest = 0;
+    for (const WebpOutput& output : outputs) {
+        largest = std::max(largest, output.max_dimension);
+    }
+
+    Image image;
+    CodecResult result = decode_image(input_path, largest, largest, image, error);
+    if (result != CodecResult::OK) {
+        return result;
+    }
+
+    // Largest first, so every resize starts from the smallest image that is
+    // still at least as big as its target.
+    std::vector<size_t> order(outputs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&outputs](size_t a, size_t b) {
+        return outputs[a].max_dimension > outputs[b].max_dimension;
+    });
+
+    std::vector<std::string> encoded(outputs.size());
+    for (size_t i : order) {
+        resize_to_fit(image, outputs[i].max_dimension, outputs[i].max_dimension);
+        result = encode_webp(image, outputs[i].quality, WEBP_METHOD, encoded[i], error);
+        if (result != CodecResult::OK) {
+            return result;
+        }
+    }
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        result = write_atomically(outputs[i].path, encoded[i], error);
+        if (result != CodecResult::OK) {
+            return result;
+        }
+    }
+    return CodecResult::OK;
+}
+
+CodecResult resize_to_webp(const std::string& input_path, const std::string& output_path,
+                           const ResizeSpec& spec, std::string& error) {
+    const int unbounded = std::numeric_limits<int>::max();
+    int max_width = spec.width > 0 ? spec.width : unbounded;
+    int max_height = spec.height > 0 ? spec.height : unbounded;
+    bool cover = spec.fit == ResizeFit::COVER && spec.width > 0 && spec.height > 0;
+
+    // Cropping changes which side limits the resize, so a cover decode is
+    // not shrunk in the DCT domain.
+    Image image;
+    CodecResult result = cover
+        ? decode_image(input_path, unbounded, unbounded, image, error)
+        : decode_image(input_path, max_width, max_height, image, error);
+    if (result != CodecResult::OK) {
+        return result;
+    }
+
+    if (cover) {
+        crop_to_aspect(image, spec.width, spec.height);
+    }
+    resize_to_fit(image, max_width, max_height);
+
+    std::string encoded;
+    result = encode_webp(image, static_cast<float>(spec.quality), WEBP_METHOD, encoded, error);
+    if (result != CodecResult::OK) {
+        return result;
+    }
+    return write_atomically(output_path, encoded, error);
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef IMAGE_CODEC_H
+#define IMAGE_CODEC_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace ImageCurry {
+
+// Mirrors compressor.sh: convert -resize "900x900>" -quality 65
+// -define webp:method=6 -strip
+constexpr int WEBP_MAX_DIMENSION = 900;
+constexpr float WEBP_QUALITY = 65.0f;
+constexpr int WEBP_METHOD = 6;
+
+// Inputs whose header declares more than this are rejected before any pixel
+// buffer is allocated, so a small decompression bomb fails its own job
+// instead of exhausting memory. 16384 is also WebP's own dimension limit.
+constexpr int DECODE_MAX_DIMENSION = 16384;
+constexpr int64_t DECODE_MAX_PIXELS = 100000000;
+
+enum class CodecResult {
+    OK,
+    UNSUPPORTED,    // no built-in decoder for this input; use compressor.sh
+    FAILED
+};
+
+struct Image {
+    int width = 0;
+    int height = 0;
+    int channels = 0;               // 3 = RGB, 4 = RGBA
+    std::vector<uint8_t> pixels;
+};
+
+bool native_encoder_available();
+
+// Decodes JPEG, PNG, GIF (first frame) or WebP. fit_width/fit_height let the
+// JPEG decoder downscale in the DCT domain while staying above the size the
+// image will later be resized to.
+CodecResult decode_image(const std::string& path, int fit_width, int fit_height,
+                         Image& image, std::string& error);
+
+// Shrinks (never enlarges) to fit inside max_width x max_height, keeping the
+// aspect ratio, with an area-averaging filter.
+void resize_to_fit(Image& image, int max_width, int max_height);
+
+CodecResult encode_webp(const Image& image, float quality, int method,
+                        std::string& out, std::string& error);
+
+enum class ResizeFit {
+    INSIDE,     // fit within width x height, keeping the aspect ratio
+    COVER       // crop to the aspect of width x height, then fit within it
+};
+
+// An on-the-fly resize (/retrieve?w=&h=&fit=&q=). A width or height of 0
+// leaves that side unbounded. Images are never enlarged.
+struct ResizeSpec {
+    int width;
+    int height;
+    ResizeFit fit;
+    int quality;
+};
+
+struct WebpOutput {
+    std::string path;
+    int max_dimension;
+    float quality;
+};
+
+// In-process equivalent of compressor.sh. The input is decoded once and each
+// output is resized from the next larger one. Metadata is never carried over,
+// so outputs are always stripped. Each is written to a temporary file and
+// renamed into place, in the order given, so readers never observe a partial
+// WebP.
+CodecResult convert_to_webp(const std::string& input_path,
+                            const std::vector<WebpOutput>& outputs, std::string& error);
+
+// Encodes a single WebP of input_path resized to spec, published the same
+// way as convert_to_webp().
+CodecResult resize_to_webp(const std::string& input_path, const std::string& output_path,
+                           const ResizeSpec& spec, std::string& error);
+
+}
+#endif
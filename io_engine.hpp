@@ -0,0 +1,20 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <csignal>
+
+namespace ImageCurry {
+
+// A per-worker I/O engine driving Connections for one listening socket.
+// Selected at startup with --engine; every engine runs the same HTTP state
+// machine, so they can be compared on the same hardware.
+class IoEngine {
+public:
+    virtual ~IoEngine() = default;
+
+    virtual bool init() = 0;
+    virtual void run(const volatile sig_atomic_t& running) = 0;
+};
+
+}
+#endif
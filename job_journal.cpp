@@ -0,0 +1,390 @@
+#include "job_journal.hpp"
+#include "config.hpp"
+#include "logging.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ImageCurry {
+
+JobJournal& JobJournal::get_instance() {
+    static JobJournal instance;
+    return instance;
+}
+
+JobJournal::~JobJournal() {
+    close();
+}
+
+static bool read_file(const std::string& path, std::string& data) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+
+    char chunk[65536];
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ::close(fd);
+            return n == 0;
+        }
+        data.append(chunk, static_cast<size_t>(n));
+    }
+}
+
+static bool exists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+bool JobJournal::open(const std::string& journal_path, std::vector<CompressionJob>& unfinished,
+                      std::unordered_set<std::string>& failed) {
+    path = journal_path;
+    sync_interval_ms = config().journal_sync_ms;
+
+    std::string data;
+    if (!read_file(path, data)) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to read " + path + ": " + std::string(strerror(errno)));
+        return false;
+    }
+
+    // Replay in order; a torn last line (no newline) was never flushed whole.
+    std::vector<std::string> order;
+    size_t start = 0;
+    while (true) {
+        size_t end = data.find('\n', start);
+        if (end == std::string::npos) break;
+        std::string line = data.substr(start, end - start);
+        start = end + 1;
+
+        if (line.size() < 3 || line[1] != ' ') continue;
+        size_t space = line.find(' ', 2);
+        std::string name = line.substr(2, space == std::string::npos ? std::string::npos
+                                                                     : space - 2);
+        switch (line[0]) {
+        case 'E':
+            if (space != std::string::npos &&
+                open_jobs.insert_or_assign(name, line.substr(space + 1)).second) {
+                order.push_back(name);
+            }
+            remove_failed(name);
+            break;
+        case 'D':
+            open_jobs.erase(name);
+            break;
+        case 'F':
+            open_jobs.erase(name);
+            add_failed(name);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // A job whose WebP exists finished but lost its D record to a crash; one
+    // whose original is gone can never run.
+    std::unordered_set<std::string> listed;
+    for (const std::string& name : order) {
+        auto it = open_jobs.find(name);
+        if (it == open_jobs.end() || !listed.insert(name).second) continue;
+        if (exists(build_serve_path(name)) || !exists(it->second)) {
+            open_jobs.erase(it);
+            continue;
+        }
+        unfinished.push_back(CompressionJob{it->second, build_serve_path(name), name, name,
+                                            std::nullopt, JobPriority::BULK, 0});
+    }
+    failed.insert(failed_order.begin(), failed_order.end());
+
+    if (!compact()) {
+        return false;
+    }
+
+    stopping = false;
+    running = true;
+    writer = std::thread(&JobJournal::writer_loop, this);
+    return true;
+}
+
+void JobJournal::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        running = false;
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+
+    ::close(fd);
+    fd = -1;
+}
+
+void JobJournal::append(const std::string& record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) {
+        buffer += record;
+    }
+}
+
+// Recovered jobs are already open, and on file since open() compacted it.
+void JobJournal::enqueued(const CompressionJob& job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remove_failed(job.name);
+        if (!open_jobs.insert_or_assign(job.name, job.input_path).second) {
+            return;
+        }
+    }
+    append("E " + job.name + " " + job.input_path + "\n");
+}
+
+void JobJournal::started(const std::string& name) {
+    append("S " + name + "\n");
+}
+
+void JobJournal::finished(const std::string& name, bool ok) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        open_jobs.erase(name);
+        if (!ok) {
+            add_failed(name);
+        }
+    }
+    append((ok ? "D " : "F ") + name + "\n");
+}
+
+// Called with the lock held (or before the writer starts). A repeated
+// failure moves to the back, so eviction drops the longest-standing ones.
+void JobJournal::add_failed(const std::string& name) {
+    remove_failed(name);
+    failed_jobs.emplace(name, failed_order.insert(failed_order.end(), name));
+    if (failed_jobs.size() > JOURNAL_MAX_FAILED) {
+        failed_jobs.erase(failed_order.front());
+        failed_order.pop_front();
+    }
+}
+
+void JobJournal::remove_failed(const std::string& name) {
+    auto it = failed_jobs.find(name);
+    if (it != failed_jobs.end()) {
+        failed_order.erase(it->second);
+        failed_jobs.erase(it);
+    }
+}
+
+bool JobJournal::write_all(int out, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(out, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Rewrites the journal as the open and failed jobs alone, then renames it
+// over the old one and makes the rename durable before appending to it.
+// Records still in buffer may repeat what the snapshot holds; replaying a
+// record twice has no effect.
+bool JobJournal::compact() {
+    std::string snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& job : open_jobs) {
+            snapshot += "E " + job.first + " " + job.second + "\n";
+        }
+        for (const std::string& name : failed_order) {
+            snapshot += "F " + name + "\n";
+        }
+    }
+
+    std::string temp_path = path + ".tmp";
+    int temp = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = temp >= 0 && write_all(temp, snapshot) && fdatasync(temp) == 0;
+    if (temp >= 0) {
+        ::close(temp);
+    }
+    if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to compact " + path + ": " + std::string(strerror(errno)));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    std::string dir = ".";
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos) {
+        dir = path.substr(0, slash);
+    }
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        ::close(dir_fd);
+    }
+
+    int appender = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (appender < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to open " + path + ": " + std::string(strerror(errno)));
+        return false;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = appender;
+    file_size = snapshot.size();
+    compacted_size = file_size;
+    return true;
+}
+
+void JobJournal::writer_loop() {
+    std::string batch;
+    while (true) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(sync_interval_ms),
+                          [this] { return stopping; });
+            stop = stopping;
+            batch.swap(buffer);
+        }
+
+        if (!batch.empty()) {
+            if (!write_all(fd, batch) || fdatasync(fd) != 0) {
+                log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                        "Journal write failed: " + std::string(strerror(errno)));
+            }
+            file_size += batch.size();
+            batch.clear();
+        }
+
+        // The snapshot itself is bounded by the open jobs and
+        // JOURNAL_MAX_FAILED, so only what was appended since counts.
+        if (file_size - compacted_size > JOURNAL_COMPACT_SIZE) {
+            compact();
+        }
+
+        if (stop) {
+            return;
+        }
+    }
+}
+
+// Originals are "<name without .webp><ext>" for one of UPLOAD_EXTENSIONS.
+static std::string webp_name_for(const std::string& original) {
+    for (const char* ext : UPLOAD_EXTENSIONS) {
+        size_t len = strlen(ext);
+        if (original.size() > len &&
+            original.compare(original.size() - len, len, ext) == 0) {
+            return original.substr(0, original.size() - len) + ".webp";
+        }
+    }
+    return "";
+}
+
+// Lists SAVE_DIR, then checks each original for its WebP on several threads:
+// on a cold disk every check is a metadata read, and they overlap well.
+static std::vector<CompressionJob> reconcile(const std::unordered_set<std::string>& skip) {
+    std::vector<std::string> originals;
+    DIR* dir = opendir(SAVE_DIR);
+    if (!dir) {
+        return {};
+    }
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (!webp_name_for(name).empty()) {
+            originals.push_back(std::move(name));
+        }
+    }
+    closedir(dir);
+
+    size_t thread_count = std::min<size_t>(
+        std::max(1u, std::thread::hardware_concurrency()), RECONCILE_MAX_THREADS);
+    thread_count = std::max<size_t>(1, std::min(thread_count, originals.size()));
+
+    std::vector<std::vector<CompressionJob>> found(thread_count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t] {
+            for (size_t i = t; i < originals.size(); i += thread_count) {
+                std::string webp = webp_name_for(originals[i]);
+                if (skip.count(webp) == 0 && !exists(build_serve_path(webp))) {
+                    found[t].push_back(CompressionJob{build_save_path(originals[i]),
+                                                      build_serve_path(webp), webp, webp,
+                                                      std::nullopt, JobPriority::BULK, 0});
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<CompressionJob> jobs;
+    for (auto& part : found) {
+        std::move(part.begin(), part.end(), std::back_inserter(jobs));
+    }
+    return jobs;
+}
+
+static std::thread recovery;
+
+void journal_start() {
+    if (config().compress_mode != CompressMode::EAGER) {
+        return;
+    }
+
+    std::vector<CompressionJob> jobs;
+    std::unordered_set<std::string> skip;
+    if (!JobJournal::get_instance().open(JOURNAL_FILE, jobs, skip)) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Compression journal disabled; unfinished jobs will not survive a restart");
+    }
+
+    size_t replayed = jobs.size();
+    for (const CompressionJob& job : jobs) {
+        skip.insert(job.name);
+    }
+
+    recovery = std::thread([jobs = std::move(jobs), skip = std::move(skip), replayed]() mutable {
+        std::vector<CompressionJob> missing = reconcile(skip);
+        size_t reconciled = missing.size();
+        std::move(missing.begin(), missing.end(), std::back_inserter(jobs));
+        if (!jobs.empty()) {
+            log_msg(LogLevel::INFO, "", 0, "", "", 0,
+                    "Recovering " + std::to_string(replayed) + " unfinished job(s) from " +
+                    JOURNAL_FILE + " and " + std::to_string(reconciled) +
+                    " original(s) without a WebP");
+        }
+
+        CompressionPool& pool = CompressionPool::get_instance();
+        for (CompressionJob& job : jobs) {
+            if (!pool.reserve(true)) {
+                return;     // shutting down; the journal still lists the rest
+            }
+            pool.submit(std::move(job));
+        }
+    });
+}
+
+void journal_stop() {
+    if (recovery.joinable()) {
+        recovery.join();
+    }
+    JobJournal::get_instance().close();
+}
+
+}
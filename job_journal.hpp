@@ -0,0 +1,87 @@
+#ifndef JOB_JOURNAL_H
+#define JOB_JOURNAL_H
+
+#include "compression.hpp"
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace ImageCurry {
+
+constexpr const char* JOURNAL_FILE = "./compression.journal";
+constexpr size_t JOURNAL_COMPACT_SIZE = 4 * 1024 * 1024;    // dead bytes before a rewrite
+constexpr size_t JOURNAL_MAX_FAILED = 10000;    // failed jobs remembered, newest kept
+constexpr int RECONCILE_MAX_THREADS = 8;
+
+// Append-only log of eager compression jobs, one line per state change:
+//   E <name> <input path>   enqueued
+//   S <name>                started
+//   D <name>                done
+//   F <name>                failed; not retried by the reconciler
+// Records are buffered and a writer thread appends them every
+// --journal-sync-ms with a single fdatasync(), so a burst of uploads costs
+// one disk flush. Records lost to a crash before their flush are made up for
+// by the startup reconciler. Once more than JOURNAL_COMPACT_SIZE has been
+// appended since the last rewrite, the file is rewritten with only the open
+// and failed jobs. Only the last JOURNAL_MAX_FAILED failures are kept; an
+// older one is forgotten and its original is tried again after a restart.
+class JobJournal {
+public:
+    static JobJournal& get_instance();
+
+    // Replays the previous run's journal into unfinished (jobs enqueued but
+    // not done, whose original still exists and WebP does not) and failed,
+    // then compacts it and starts the writer.
+    bool open(const std::string& path, std::vector<CompressionJob>& unfinished,
+              std::unordered_set<std::string>& failed);
+    void close();
+
+    void enqueued(const CompressionJob& job);
+    void started(const std::string& name);
+    void finished(const std::string& name, bool ok);
+
+private:
+    JobJournal() = default;
+    JobJournal(const JobJournal&) = delete;
+    JobJournal& operator=(const JobJournal&) = delete;
+    ~JobJournal();
+
+    void append(const std::string& record);
+    void writer_loop();
+    bool write_all(int fd, const std::string& data);
+    bool compact();
+    void add_failed(const std::string& name);
+    void remove_failed(const std::string& name);
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::string buffer;                     // records not yet written
+    std::unordered_map<std::string, std::string> open_jobs;    // name -> input path
+    std::list<std::string> failed_order;    // oldest first
+    std::unordered_map<std::string, std::list<std::string>::iterator> failed_jobs;
+    bool stopping = false;
+    bool running = false;
+    std::thread writer;
+
+    std::string path;
+    int fd = -1;                            // writer thread once running
+    size_t file_size = 0;
+    size_t compacted_size = 0;              // file_size right after the last rewrite
+    int sync_interval_ms = 50;
+};
+
+// Startup recovery for --compress-mode=eager: replays the journal, then scans
+// SAVE_DIR against SERVE_DIR on several threads for originals that have no
+// WebP and are neither queued nor known to fail. Both kinds of job are fed
+// to the compression pool from a background thread, waiting for queue space,
+// so the server starts serving at once. Call after compression_start().
+void journal_start();
+void journal_stop();
+
+}
+#endif
@@ -1,10 +1,18 @@
 #include "logging.hpp"
+#include "config.hpp"
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
-#include <ctime>
-#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ImageCurry {
 
+static_assert((LOG_RING_CAPACITY & (LOG_RING_CAPACITY - 1)) == 0,
+              "LOG_RING_CAPACITY must be a power of two");
+
 Logger::~Logger() {
     close();
 }
@@ -15,53 +23,199 @@ Logger& Logger::get_instance() {
 }
 
 void Logger::init(const std::string& filename) {
-    if (log_fp && log_fp != stderr && log_fp != stdout) {
-        fclose(log_fp);
+    if (running.load()) {
+        return;
     }
 
-    log_fp = fopen(filename.c_str(), "a");
-    if (!log_fp) {
-        log_fp = stderr;
+    log_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        log_fd = STDERR_FILENO;
     }
-}
 
-void Logger::close() {
-    if (log_fp && log_fp != stderr && log_fp != stdout) {
-        fclose(log_fp);
-        log_fp = nullptr;
+    flush_interval_ms = config().log_flush_ms;
+    block_when_full = config().log_overflow == LogOverflow::BLOCK;
+
+    ring.reset(new Record[LOG_RING_CAPACITY]);
+    for (size_t i = 0; i < LOG_RING_CAPACITY; i++) {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
     }
+    enqueue_pos.store(0, std::memory_order_relaxed);
+    dequeue_pos = 0;
+    stopping = false;
+
+    writer = std::thread(&Logger::writer_loop, this);
+    running.store(true, std::memory_order_release);
 }
 
-void Logger::log(LogLevel level, const std::string& client_ip, int client_port,
-                 const std::string& method, const std::string& path, int status,
-                 const std::string& message) {
-    if (level < min_log_level || !log_fp) {
+void Logger::close() {
+    if (!running.exchange(false)) {
         return;
     }
 
-    static const char* level_str[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
 
-    time_t now = time(nullptr);
-    struct tm tm;
-    localtime_r(&now, &tm);
+    if (log_fd != STDERR_FILENO) {
+        ::close(log_fd);
+    }
+    log_fd = -1;
+}
 
-    char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+void Logger::log(LogLevel level, std::string_view client_ip, int client_port,
+                 std::string_view method, std::string_view path, int status,
+                 std::string_view message) {
+    if (level < min_log_level || !running.load(std::memory_order_acquire)) {
+        return;
+    }
 
-    fprintf(log_fp, "[%s] %-5s | ", timestamp, level_str[static_cast<int>(level)]);
+    // Only the cheap part of formatting happens here; the timestamp and level
+    // are rendered by the writer thread.
+    char text[LOG_RECORD_SIZE];
+    size_t length = 0;
+    auto append = [&](int n) {
+        if (n > 0) length = std::min(length + static_cast<size_t>(n), sizeof(text) - 1);
+    };
 
     if (!client_ip.empty()) {
-        fprintf(log_fp, "%s:%d | ", client_ip.c_str(), client_port);
+        append(snprintf(text, sizeof(text), "%.*s:%d | ",
+                        static_cast<int>(client_ip.size()), client_ip.data(), client_port));
     } else {
-        fprintf(log_fp, "SYSTEM | ");
+        append(snprintf(text, sizeof(text), "SYSTEM | "));
     }
 
     if (!method.empty() && !path.empty()) {
-        fprintf(log_fp, "%s %s | %d | ", method.c_str(), path.c_str(), status);
+        append(snprintf(text + length, sizeof(text) - length, "%.*s %.*s | %d | ",
+                        static_cast<int>(method.size()), method.data(),
+                        static_cast<int>(path.size()), path.data(), status));
     }
 
-    fprintf(log_fp, "%s\n", message.c_str());
-    fflush(log_fp);
+    append(snprintf(text + length, sizeof(text) - length, "%.*s",
+                    static_cast<int>(message.size()), message.data()));
+
+    time_t now = time(nullptr);
+    while (!push(now, level, text, length)) {
+        if (!block_when_full || !running.load(std::memory_order_relaxed)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        wake.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+// Bounded MPSC ring with per-slot sequence numbers: a slot is free for the
+// producer claiming position pos when its sequence equals pos, and readable
+// by the writer once the producer publishes pos + 1.
+bool Logger::push(time_t now, LogLevel level, const char* text, size_t length) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Record* record;
+    while (true) {
+        record = &ring[pos & (LOG_RING_CAPACITY - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->time = now;
+    record->level = level;
+    record->length = length;
+    memcpy(record->text, text, length);
+    record->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// Records arrive roughly in time order, so strftime runs about once per second.
+const char* Logger::timestamp(time_t when) {
+    if (when != formatted_second) {
+        struct tm tm;
+        localtime_r(&when, &tm);
+        strftime(formatted_timestamp, sizeof(formatted_timestamp), "%Y-%m-%d %H:%M:%S", &tm);
+        formatted_second = when;
+    }
+    return formatted_timestamp;
+}
+
+bool Logger::pop(std::string& batch) {
+    static const char* level_str[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+    Record& record = ring[dequeue_pos & (LOG_RING_CAPACITY - 1)];
+    if (record.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+        return false;
+    }
+
+    char prefix[64];
+    int n = snprintf(prefix, sizeof(prefix), "[%s] %-5s | ", timestamp(record.time),
+                     level_str[static_cast<int>(record.level)]);
+    batch.append(prefix, static_cast<size_t>(n));
+    batch.append(record.text, record.length);
+    batch += '\n';
+
+    record.sequence.store(dequeue_pos + LOG_RING_CAPACITY, std::memory_order_release);
+    dequeue_pos++;
+    return true;
+}
+
+void Logger::write_batch(std::string& batch) {
+    size_t done = 0;
+    while (done < batch.size()) {
+        ssize_t n = ::write(log_fd, batch.data() + done, batch.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    batch.clear();
+}
+
+void Logger::writer_loop() {
+    std::string batch;
+    batch.reserve(LOG_BATCH_SIZE);
+
+    while (true) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(flush_interval_ms),
+                          [this] { return stopping; });
+            stop = stopping;
+        }
+
+        while (pop(batch)) {
+            if (batch.size() >= LOG_BATCH_SIZE) {
+                write_batch(batch);
+            }
+        }
+
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            char line[128];
+            int n = snprintf(line, sizeof(line),
+                             "[%s] WARN  | SYSTEM | Dropped %llu log record(s), ring buffer full\n",
+                             timestamp(time(nullptr)), static_cast<unsigned long long>(lost));
+            batch.append(line, static_cast<size_t>(n));
+        }
+
+        if (!batch.empty()) {
+            write_batch(batch);
+        }
+
+        if (stop) {
+            return;
+        }
+    }
 }
 
 void log_init(const std::string& filename) {
@@ -72,9 +226,9 @@ void log_close() {
     Logger::get_instance().close();
 }
 
-void log_msg(LogLevel level, const std::string& client_ip, int client_port,
-             const std::string& method, const std::string& path, int status,
-             const std::string& message) {
+void log_msg(LogLevel level, std::string_view client_ip, int client_port,
+             std::string_view method, std::string_view path, int status,
+             std::string_view message) {
     Logger::get_instance().log(level, client_ip, client_port, method, path, status,
                                message);
 }
@@ -2,9 +2,22 @@
 #define LOGGING_H
 
 #include <string>
+#include <string_view>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
 
 namespace ImageCurry {
 
+constexpr size_t LOG_RING_CAPACITY = 4096;      // records; must be a power of two
+constexpr size_t LOG_RECORD_SIZE = 512;         // longer lines are truncated
+constexpr size_t LOG_BATCH_SIZE = 64 * 1024;
+
 enum class LogLevel {
     DEBUG,
     INFO,
@@ -12,30 +25,65 @@ enum class LogLevel {
     ERROR
 };
 
+// Asynchronous logger. Callers format their record into a slot of a bounded
+// lock-free MPSC ring and return; a single writer thread drains the ring
+// every flush interval and appends the records to the log file in large
+// batched writes. When the ring is full the record is dropped and counted,
+// or the caller waits, depending on --log-overflow.
 class Logger {
 public:
     static Logger& get_instance();
     void init(const std::string& filename);
     void close();
-    void log(LogLevel level, const std::string& client_ip, int client_port,
-             const std::string& method, const std::string& path, int status,
-             const std::string& message);
+    void log(LogLevel level, std::string_view client_ip, int client_port,
+             std::string_view method, std::string_view path, int status,
+             std::string_view message);
 
 private:
+    struct Record {
+        std::atomic<size_t> sequence;
+        time_t time;
+        LogLevel level;
+        size_t length;
+        char text[LOG_RECORD_SIZE];
+    };
+
     Logger() = default;
     Logger(const Logger&) = delete;
     Logger& operator=(const Logger&) = delete;
     ~Logger();
 
-    FILE* log_fp = nullptr;
+    bool push(time_t now, LogLevel level, const char* text, size_t length);
+    bool pop(std::string& batch);
+    const char* timestamp(time_t when);
+    void writer_loop();
+    void write_batch(std::string& batch);
+
+    std::unique_ptr<Record[]> ring;
+    std::atomic<size_t> enqueue_pos{0};
+    size_t dequeue_pos = 0;                 // writer thread only
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> running{false};
+
+    std::mutex mutex;                       // guards stopping for the writer's wait
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread writer;
+
+    int log_fd = -1;
     LogLevel min_log_level = LogLevel::INFO;
+    int flush_interval_ms = 100;
+    bool block_when_full = false;
+
+    time_t formatted_second = 0;            // writer thread only
+    char formatted_timestamp[32] = {0};
 };
 
 void log_init(const std::string& filename);
 void log_close();
-void log_msg(LogLevel level, const std::string& client_ip, int client_port,
-             const std::string& method, const std::string& path, int status,
-             const std::string& message);
+void log_msg(LogLevel level, std::string_view client_ip, int client_port,
+             std::string_view method, std::string_view path, int status,
+             std::string_view message);
 
 }
 #endif
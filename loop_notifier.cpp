@@ -0,0 +1,47 @@
+#include "loop_notifier.hpp"
+#include "logging.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace ImageCurry {
+
+bool LoopNotifier::init() {
+    event_fd_.reset(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if (!event_fd_) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to create eventfd: " + std::string(strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+void LoopNotifier::post(std::shared_ptr<WaitTicket> ticket) {
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        was_empty = posted_.empty();
+        posted_.push_back(std::move(ticket));
+    }
+
+    // One wakeup covers everything posted before the engine drains.
+    if (was_empty) {
+        uint64_t one = 1;
+        ssize_t ignored = write(event_fd_.get(), &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+std::vector<std::shared_ptr<WaitTicket>> LoopNotifier::drain() {
+    uint64_t count;
+    ssize_t ignored = read(event_fd_.get(), &count, sizeof(count));
+    (void)ignored;
+
+    std::vector<std::shared_ptr<WaitTicket>> tickets;
+    std::lock_guard<std::mutex> lock(mutex_);
+    tickets.swap(posted_);
+    return tickets;
+}
+
+}
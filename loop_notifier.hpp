@@ -0,0 +1,44 @@
+#ifndef LOOP_NOTIFIER_H
+#define LOOP_NOTIFIER_H
+
+#include "utils.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+namespace ImageCurry {
+
+class LoopNotifier;
+
+// Names a connection parked on work done by another thread. key is whatever
+// the owning engine uses to find the connection (its fd, or its id).
+struct WaitTicket {
+    LoopNotifier* notifier;
+    uint64_t key;
+};
+
+// Hands finished tickets from other threads back to an I/O engine: post()
+// queues the ticket and signals an eventfd that the engine watches like any
+// other descriptor, then drain() collects what was posted.
+class LoopNotifier {
+public:
+    LoopNotifier() = default;
+
+    LoopNotifier(const LoopNotifier&) = delete;
+    LoopNotifier& operator=(const LoopNotifier&) = delete;
+
+    bool init();
+    int fd() const { return event_fd_.get(); }
+
+    void post(std::shared_ptr<WaitTicket> ticket);
+    std::vector<std::shared_ptr<WaitTicket>> drain();
+
+private:
+    ScopedFileDescriptor event_fd_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<WaitTicket>> posted_;
+};
+
+}
+#endif
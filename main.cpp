@@ -1,66 +1,39 @@
 #include "logging.hpp"
+#include "http_request.hpp"
 #include "http_response.hpp"
 #include "handlers.hpp"
 #include "utils.hpp"
+#include "event_loop.hpp"
+#include "uring_loop.hpp"
+#include "config.hpp"
+#include "compression.hpp"
+#include "object_cache.hpp"
+#include "job_journal.hpp"
+#include "child_supervisor.hpp"
+#include "compression_helper.hpp"
 #include <iostream>
 #include <string>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <functional>
 #include <cstring>
 #include <cerrno>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 
 namespace ImageCurry {
 
 constexpr int SERVER_PORT = 8080;
 constexpr int MAX_CONNECTIONS = 128;
-constexpr int REQUEST_TIMEOUT = 30;
-constexpr size_t MAX_REQUEST_SIZE = 128 * 1024 * 1024;
 constexpr const char* LOG_FILE = "./server.log";
 
-class ScopedFileDescriptor {
-public:
-    explicit ScopedFileDescriptor(int fd = -1) : fd_(fd) {}
-    ~ScopedFileDescriptor() { close_fd(); }
-
-    ScopedFileDescriptor(const ScopedFileDescriptor&) = delete;
-    ScopedFileDescriptor& operator=(const ScopedFileDescriptor&) = delete;
-
-    ScopedFileDescriptor(ScopedFileDescriptor&& other) noexcept : fd_(other.fd_) {
-        other.fd_ = -1;
-    }
-
-    ScopedFileDescriptor& operator=(ScopedFileDescriptor&& other) noexcept {
-        if (this != &other) {
-            close_fd();
-            fd_ = other.fd_;
-            other.fd_ = -1;
-        }
-        return *this;
-    }
-
-    int get() const { return fd_; }
-    int release() { int tmp = fd_; fd_ = -1; return tmp; }
-    explicit operator bool() const { return fd_ >= 0; }
-
-private:
-    void close_fd() {
-        if (fd_ >= 0) {
-            close(fd_);
-            fd_ = -1;
-        }
-    }
-
-    int fd_;
-};
-
 static volatile sig_atomic_t server_running = 1;
 
 void signal_handler(int signum) {
@@ -87,157 +60,118 @@ bool ensure_directory(const std::string& path) {
     return true;
 }
 
-void process_request(int client_fd, const std::string& client_ip, int client_port) {
-    ScopedFileDescriptor fd_holder(client_fd);
-
-    struct timeval tv;
-    tv.tv_sec = REQUEST_TIMEOUT;
-    tv.tv_usec = 0;
-    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    std::vector<char> buffer(BUFFER_SIZE);
-    ssize_t received = 0;
-    char* header_end = nullptr;
-
-    while (received < static_cast<ssize_t>(BUFFER_SIZE) - 1) {
-        ssize_t n = recv(client_fd, buffer.data() + received, BUFFER_SIZE - received - 1, 0);
-        if (n <= 0) {
-            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                log_msg(LogLevel::ERROR, client_ip, client_port, "", "", 0,
-                        "Receive error: " + std::string(strerror(errno)));
-            }
-            return;
-        }
-        received += n;
-        buffer[received] = '\0';
-        header_end = strstr(buffer.data(), "\r\n\r\n");
-        if (header_end) break;
+ScopedFileDescriptor create_listener(int port) {
+    ScopedFileDescriptor server_fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!server_fd) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to create socket: " + std::string(strerror(errno)));
+        return server_fd;
     }
 
-    if (!header_end) {
-        log_msg(LogLevel::WARN, client_ip, client_port, "INVALID", "", 400,
-                "Headers too large or malformed");
-        send_error(client_fd, 400, "Headers too large or malformed");
-        return;
+    int opt = 1;
+    if (setsockopt(server_fd.get(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        log_msg(LogLevel::WARN, "", 0, "", "", 0,
+                "Failed to set SO_REUSEADDR: " + std::string(strerror(errno)));
     }
 
-    std::string method, path, version;
-    char method_buf[16] = {0}, path_buf[512] = {0}, version_buf[16] = {0};
-
-    if (sscanf(buffer.data(), "%15s %511s %15s", method_buf, path_buf, version_buf) != 3) {
-        log_msg(LogLevel::WARN, client_ip, client_port, "INVALID", "", 400,
-                "Malformed request");
-        send_error(client_fd, 400, "Malformed request");
-        return;
+    // Every worker binds its own socket to the same port; the kernel spreads
+    // incoming connections across them without a shared accept lock.
+    if (setsockopt(server_fd.get(), SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to set SO_REUSEPORT: " + std::string(strerror(errno)));
+        return ScopedFileDescriptor();
     }
 
-    method = method_buf;
-    path = path_buf;
-    version = version_buf;
+    struct sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
 
-    if (version != "HTTP/1.1" && version != "HTTP/1.0") {
-        log_msg(LogLevel::WARN, client_ip, client_port, method, path, 400,
-                "Invalid HTTP version: " + version);
-        send_error(client_fd, 400, "Invalid HTTP version");
-        return;
+    if (bind(server_fd.get(), (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to bind to port " + std::to_string(port) + ": " +
+                std::string(strerror(errno)));
+        return ScopedFileDescriptor();
     }
 
-    if (method == "OPTIONS") {
-        handle_options(client_fd, client_ip, client_port);
-        return;
+    if (listen(server_fd.get(), MAX_CONNECTIONS) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to listen: " + std::string(strerror(errno)));
+        return ScopedFileDescriptor();
     }
 
-    size_t query_pos = path.find('?');
-    std::string path_only = (query_pos != std::string::npos) ? path.substr(0, query_pos) : path;
-    std::string query_part = (query_pos != std::string::npos) ? path.substr(query_pos + 1) : "";
-
-    std::string body;
-    size_t body_len = 0;
-    std::string request_str(buffer.data());
-
-    auto content_len_pos = request_str.find("Content-Length:");
-    if (content_len_pos != std::string::npos) {
-        size_t content_length = std::stoul(request_str.substr(content_len_pos + 15));
-
-        if (content_length > MAX_REQUEST_SIZE) {
-            send_error(client_fd, 413, "Payload Too Large");
-            return;
-        }
-
-        if (content_length > 0) {
-            body.resize(content_length);
-
-            size_t header_len = (header_end - buffer.data()) + 4;
-            ssize_t body_part_len = received - header_len;
+    return server_fd;
+}
 
-            if (body_part_len > 0) {
-                std::memcpy(body.data(), header_end + 4, body_part_len);
-            }
-            body_len = (body_part_len > 0) ? body_part_len : 0;
-
-            while (body_len < content_length) {
-                ssize_t n = recv(client_fd, body.data() + body_len,
-                                 content_length - body_len, 0);
-                if (n <= 0) {
-                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                        log_msg(LogLevel::ERROR, client_ip, client_port, "", "", 0,
-                                "Receive error: " + std::string(strerror(errno)));
-                    }
-                    return;
-                }
-                body_len += n;
+std::vector<int> available_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
             }
         }
     }
+    return cpus;
+}
 
-    if (method == "POST") {
-        if (path_only != "/upload") {
-            log_msg(LogLevel::WARN, client_ip, client_port, method, path, 400,
-                    "Invalid path for POST - only /upload is supported");
-            send_error(client_fd, 400, "Invalid path - POST only accepts /upload");
-            return;
-        }
-        handle_upload(client_fd, request_str, body, body_len, client_ip, client_port);
-        return;
-    } else if (method == "GET" || method == "HEAD") {
-        if (path_only != "/retrieve") {
-            log_msg(LogLevel::WARN, client_ip, client_port, method, path, 400,
-                    "Invalid path - GET/HEAD only accepts /retrieve");
-            send_error(client_fd, 400, "Invalid path - GET/HEAD only accepts /retrieve");
-            return;
-        }
-
-        std::string filename;
-        if (query_part.empty() || !get_query_param(query_part, "name", filename)) {
-            log_msg(LogLevel::WARN, client_ip, client_port, method, path, 400,
-                    "Missing 'name' parameter");
-            send_error(client_fd, 400, "Missing 'name' parameter");
-            return;
-        }
+void pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        log_msg(LogLevel::WARN, "", 0, "", "", 0,
+                "Failed to pin worker to CPU " + std::to_string(cpu) + ": " +
+                std::string(strerror(rc)));
+    }
+}
 
-        if (!valid_filename(filename)) {
-            log_msg(LogLevel::WARN, client_ip, client_port, method, path, 400,
-                    "Invalid filename: " + filename);
-            send_error(client_fd, 400, "Invalid filename");
-            return;
-        }
+std::unique_ptr<IoEngine> create_engine(int listen_fd) {
+#ifdef IMAGECURRY_WITH_IO_URING
+    if (config().engine == EngineMode::IO_URING) {
+        return std::make_unique<UringLoop>(listen_fd);
+    }
+#endif
+    return std::make_unique<EventLoop>(listen_fd);
+}
 
-        bool is_head = (method == "HEAD");
-        handle_retrieve(client_fd, request_str, filename, client_ip, client_port, is_head);
-        return;
-    } else {
-        log_msg(LogLevel::WARN, client_ip, client_port, method, path, 501,
-                "Method not implemented");
-        send_error(client_fd, 501, "Method not implemented");
-        return;
+void run_worker(int id, IoEngine& loop, int cpu) {
+    if (cpu >= 0) {
+        pin_current_thread(cpu);
     }
+
+    log_msg(LogLevel::INFO, "", 0, "", "", 0,
+            "Worker " + std::to_string(id) + " started" +
+            (cpu >= 0 ? " on CPU " + std::to_string(cpu) : ""));
+    loop.run(server_running);
 }
 
 }
 
-int main(void) {
+int main(int argc, char** argv) {
     using namespace ImageCurry;
 
+    if (argc == 2 && strcmp(argv[1], COMPRESSION_HELPER_ARG) == 0) {
+        // The helper's supervisor logs timeouts; append them to the same file.
+        log_init(LOG_FILE);
+        int rc = compression_helper_main();
+        log_close();
+        return rc;
+    }
+
+    std::string config_error;
+    if (!load_config(argc, argv, config_error)) {
+        std::cerr << config_error << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Before any thread starts, so that all of them inherit the mask.
+    ChildSupervisor::block_sigchld();
+
     log_init(LOG_FILE);
     log_msg(LogLevel::INFO, "", 0, "", "", 0,
             "Server starting on port " + std::to_string(SERVER_PORT) + " with CORS enabled");
@@ -252,71 +186,75 @@ int main(void) {
         return 1;
     }
 
+    if (!config().resize_sizes.empty() && !ensure_directory(DERIVED_DIR)) {
+        std::cerr << "Failed to create derived directory\n";
+        return 1;
+    }
+
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    ScopedFileDescriptor server_fd(socket(AF_INET, SOCK_STREAM, 0));
-    if (!server_fd) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "Failed to create socket: " + std::string(strerror(errno)));
-        return 1;
-    }
-
-    int opt = 1;
-    if (setsockopt(server_fd.get(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        log_msg(LogLevel::WARN, "", 0, "", "", 0,
-                "Failed to set SO_REUSEADDR: " + std::string(strerror(errno)));
+    std::vector<int> cpus = available_cpus();
+    int worker_count = config().workers;
+    if (worker_count <= 0) {
+        worker_count = cpus.empty() ? 1 : static_cast<int>(cpus.size());
     }
 
-    struct sockaddr_in server_addr = {};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    std::vector<ScopedFileDescriptor> listeners;
+    std::vector<std::unique_ptr<IoEngine>> loops;
+    for (int i = 0; i < worker_count; i++) {
+        ScopedFileDescriptor listener = create_listener(SERVER_PORT);
+        if (!listener) {
+            return 1;
+        }
 
-    if (bind(server_fd.get(), (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "Failed to bind to port " + std::to_string(SERVER_PORT) + ": " +
-                std::string(strerror(errno)));
-        return 1;
-    }
+        auto loop = create_engine(listener.get());
+        if (!loop->init()) {
+            return 1;
+        }
 
-    if (listen(server_fd.get(), MAX_CONNECTIONS) < 0) {
-        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                "Failed to listen: " + std::string(strerror(errno)));
-        return 1;
+        listeners.push_back(std::move(listener));
+        loops.push_back(std::move(loop));
     }
 
     log_msg(LogLevel::INFO, "", 0, "", "", 0,
-            "Server listening on port " + std::to_string(SERVER_PORT));
+            "Server listening on port " + std::to_string(SERVER_PORT) + " with " +
+            std::to_string(worker_count) + " worker(s)");
     std::cout << "HTTP File Server running on http://localhost:" << SERVER_PORT << "\n";
     std::cout << "Upload endpoint: POST /upload\n";
     std::cout << "Retrieve endpoint: GET/HEAD /retrieve?name=<filename>\n";
     std::cout << "Serve directory (GET/HEAD): " << SERVE_DIR << "\n";
     std::cout << "Save directory (POST): " << SAVE_DIR << "\n";
     std::cout << "CORS: Enabled (Access-Control-Allow-Origin: *)\n";
+    std::cout << "Workers: " << worker_count << (config().pin_cpus ? " (pinned)" : "")
+              << ", engine: " << (config().engine == EngineMode::IO_URING ? "io_uring" : "epoll")
+              << ", header scan: " << header_scanner() << "\n";
     std::cout << "Press Ctrl+C to stop\n\n";
 
-    while (server_running) {
-        struct sockaddr_in client_addr = {};
-        socklen_t client_len = sizeof(client_addr);
+    ObjectCache::get_instance().configure(static_cast<size_t>(config().cache_size_mb) * 1024 * 1024);
+    compression_start();
+    journal_start();
 
-        int client_fd = accept(server_fd.get(), (struct sockaddr *)&client_addr, &client_len);
-        if (client_fd < 0) {
-            if (errno == EINTR) continue;
-            log_msg(LogLevel::ERROR, "", 0, "", "", 0,
-                    "Accept failed: " + std::string(strerror(errno)));
-            continue;
-        }
+    auto cpu_for = [&](int id) {
+        if (!config().pin_cpus || cpus.empty()) return -1;
+        return cpus[id % cpus.size()];
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < worker_count; i++) {
+        threads.emplace_back(run_worker, i, std::ref(*loops[i]), cpu_for(i));
+    }
 
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
-        int client_port = ntohs(client_addr.sin_port);
+    run_worker(0, *loops[0], cpu_for(0));
 
-        process_request(client_fd, std::string(client_ip), client_port);
+    for (auto& t : threads) {
+        t.join();
     }
 
     log_msg(LogLevel::INFO, "", 0, "", "", 0, "Server shutting down");
+    compression_stop();
+    journal_stop();
     log_close();
 
     std::cout << "\nServer stopped\n";
@@ -0,0 +1,167 @@
+#include "object_cache.hpp"
+#include <algorithm>
+
+namespace ImageCurry {
+
+ObjectCache& ObjectCache::get_instance() {
+    static ObjectCache instance;
+    return instance;
+}
+
+void ObjectCache::configure(size_t budget_bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = budget_bytes;
+    evict();
+}
+
+std::shared_ptr<const CachedObject> ObjectCache::lookup(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(name);
+    if (it == entries.end()) {
+        return nullptr;
+    }
+
+    Entry& entry = it->second;
+    if (entry.frequency < CACHE_MAX_FREQUENCY) {
+        entry.frequency++;
+    }
+    return entry.object;
+}
+
+void ObjectCache::insert(const std::string& name, std::shared_ptr<const CachedObject> object,
+                         uint64_t generation) {
+    size_t size = object->header.size() + object->body.size();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (generation != invalidations || size > budget || size > CACHE_MAX_OBJECT_SIZE) {
+        return;
+    }
+
+    auto existing = entries.find(name);
+    if (existing != entries.end()) {
+        remove(existing);
+    }
+
+    Entry entry;
+    entry.object = std::move(object);
+    entry.size = size;
+
+    // A recently evicted key that is requested again has proven it is not a
+    // one-hit wonder, so it skips probation.
+    auto ghost = ghosts.find(name);
+    if (ghost != ghosts.end()) {
+        ghost_queue.erase(ghost->second);
+        ghosts.erase(ghost);
+        entry.in_main = true;
+        main_queue.push_front(name);
+        entry.position = main_queue.begin();
+        main_bytes += size;
+    } else {
+        small_queue.push_front(name);
+        entry.position = small_queue.begin();
+        small_bytes += size;
+    }
+
+    entries.emplace(name, std::move(entry));
+    evict();
+}
+
+uint64_t ObjectCache::generation() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return invalidations;
+}
+
+void ObjectCache::invalidate(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    invalidations++;
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        remove(it);
+    }
+}
+
+void ObjectCache::evict() {
+    while (small_bytes + main_bytes > budget) {
+        if (!small_queue.empty() &&
+            (main_queue.empty() || small_bytes * 100 >= budget * CACHE_SMALL_QUEUE_PERCENT)) {
+            evict_small();
+        } else {
+            evict_main();
+        }
+    }
+}
+
+// Objects hit at least once while in the small queue are promoted; the rest
+// are dropped and remembered as ghosts.
+void ObjectCache::evict_small() {
+    std::string name = small_queue.back();
+    small_queue.pop_back();
+
+    Entry& entry = entries[name];
+    small_bytes -= entry.size;
+
+    if (entry.frequency > 0) {
+        entry.frequency = 0;
+        entry.in_main = true;
+        main_queue.push_front(name);
+        entry.position = main_queue.begin();
+        main_bytes += entry.size;
+        return;
+    }
+
+    entries.erase(name);
+    remember_ghost(name);
+}
+
+// Main queue is a CLOCK-style FIFO: objects that were hit get reinserted
+// with one less credit instead of being evicted.
+void ObjectCache::evict_main() {
+    while (!main_queue.empty()) {
+        std::string name = main_queue.back();
+        main_queue.pop_back();
+
+        Entry& entry = entries[name];
+        if (entry.frequency > 0) {
+            entry.frequency--;
+            main_queue.push_front(name);
+            entry.position = main_queue.begin();
+            continue;
+        }
+
+        main_bytes -= entry.size;
+        entries.erase(name);
+        return;
+    }
+}
+
+// The ghost queue holds keys only and is bounded by the number of cached
+// objects, roughly the reuse distance the main queue can cover.
+void ObjectCache::remember_ghost(const std::string& name) {
+    auto ghost = ghosts.find(name);
+    if (ghost != ghosts.end()) {
+        ghost_queue.erase(ghost->second);
+        ghosts.erase(ghost);
+    }
+    ghost_queue.push_front(name);
+    ghosts.emplace(name, ghost_queue.begin());
+
+    size_t limit = std::max<size_t>(entries.size(), 64);
+    while (ghost_queue.size() > limit) {
+        ghosts.erase(ghost_queue.back());
+        ghost_queue.pop_back();
+    }
+}
+
+void ObjectCache::remove(std::unordered_map<std::string, Entry>::iterator it) {
+    Entry& entry = it->second;
+    if (entry.in_main) {
+        main_queue.erase(entry.position);
+        main_bytes -= entry.size;
+    } else {
+        small_queue.erase(entry.position);
+        small_bytes -= entry.size;
+    }
+    entries.erase(it);
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageCurry {
+
+// Larger files are always streamed from disk with sendfile().
+constexpr size_t CACHE_MAX_OBJECT_SIZE = 4 * 1024 * 1024;
+// Share of the byte budget given to the probationary (small) queue.
+constexpr size_t CACHE_SMALL_QUEUE_PERCENT = 10;
+constexpr uint8_t CACHE_MAX_FREQUENCY = 3;
+
+// A serve-directory file held in memory. header is the complete 200 response
+// header except for the Connection line and the blank line that ends it,
+// which depend on the connection serving it.
+struct CachedObject {
+    std::string header;
+    std::string body;
+    std::string etag;
+    std::string last_modified;
+};
+
+// Byte-bounded cache of serve-directory objects shared by all workers, using
+// S3-FIFO eviction: new objects enter a small FIFO and are promoted to the
+// main FIFO only if they were hit while there, so one-off scans cannot flush
+// the hot set. Keys evicted from the small queue are remembered in a ghost
+// queue and go straight to the main queue if requested again soon.
+class ObjectCache {
+public:
+    static ObjectCache& get_instance();
+    void configure(size_t budget_bytes);
+    bool enabled() const { return budget > 0; }
+
+    std::shared_ptr<const CachedObject> lookup(const std::string& name);
+    // generation is the value of generation() taken before the file was
+    // opened; the insert is skipped if an invalidation happened since, as
+    // the object may have been read while it was being replaced.
+    void insert(const std::string& name, std::shared_ptr<const CachedObject> object,
+                uint64_t generation);
+    void invalidate(const std::string& name);
+    uint64_t generation();
+
+private:
+    struct Entry {
+        std::shared_ptr<const CachedObject> object;
+        size_t size = 0;
+        uint8_t frequency = 0;
+        bool in_main = false;
+        std::list<std::string>::iterator position;
+    };
+
+    ObjectCache() = default;
+    ObjectCache(const ObjectCache&) = delete;
+    ObjectCache& operator=(const ObjectCache&) = delete;
+
+    void evict();
+    void evict_small();
+    void evict_main();
+    void remember_ghost(const std::string& name);
+    void remove(std::unordered_map<std::string, Entry>::iterator it);
+
+    std::mutex mutex;
+    size_t budget = 0;
+    uint64_t invalidations = 0;
+    size_t small_bytes = 0;
+    size_t main_bytes = 0;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> small_queue;     // front = newest
+    std::list<std::string> main_queue;
+    std::list<std::string> ghost_queue;
+    std::unordered_map<std::string, std::list<std::string>::iterator> ghosts;
+};
+
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+namespace ImageCurry {
+
+// Incremental SHA-256 (FIPS 180-4), fed as body bytes stream in so the digest
+// is ready the moment the last byte is written.
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const char* data, size_t len);
+    // Lowercase hex digest. The object must not be updated afterwards.
+    std::string hex_digest();
+
+private:
+    void compress(const uint8_t* block);
+
+    uint32_t state_[8];
+    uint8_t block_[64];
+    size_t block_len_ = 0;
+    uint64_t total_len_ = 0;
+};
+
+}
+#endif
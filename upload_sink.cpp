@@ -0,0 +1,87 @@
+#include "upload_sink.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ImageCurry {
+
+UploadSink::~UploadSink() {
+    if (!temp_path_.empty()) {
+        fd_.reset();
+        unlink(temp_path_.c_str());
+    }
+}
+
+bool UploadSink::open(const std::string& temp_path) {
+    fd_.reset(::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+    if (!fd_) {
+        error_ = errno;
+        return false;
+    }
+    temp_path_ = temp_path;
+    return true;
+}
+
+// data starts at body offset size_; keep whatever part of it falls inside the
+// first MAGIC_PREFIX_LEN bytes and has not been recorded yet.
+void UploadSink::record_prefix(const char* data, size_t len) {
+    if (prefix_.size() >= MAGIC_PREFIX_LEN || size_ + len <= prefix_.size()) {
+        return;
+    }
+    // Bytes before data were stored without being recorded, so the prefix
+    // can no longer be completed contiguously.
+    if (size_ > prefix_.size()) {
+        return;
+    }
+
+    size_t skip = prefix_.size() - size_;
+    size_t take = std::min(len - skip, MAGIC_PREFIX_LEN - prefix_.size());
+    prefix_.append(data + skip, take);
+}
+
+void UploadSink::peeked(const char* data, size_t len) {
+    record_prefix(data, len);
+}
+
+void UploadSink::write(const char* data, size_t len) {
+    record_prefix(data, len);
+
+    // Once a write fails the rest of the body is still consumed (so the
+    // connection stays in sync) but no longer stored.
+    while (len > 0 && !failed()) {
+        ssize_t n = ::write(fd_.get(), data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error_ = errno;
+            return;
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+        size_ += static_cast<size_t>(n);
+    }
+}
+
+bool UploadSink::commit(const std::string& final_path, bool replace) {
+    if (failed()) {
+        return false;
+    }
+
+    fd_.reset();
+    if (!replace) {
+        if (link(temp_path_.c_str(), final_path.c_str()) != 0) {
+            error_ = errno;
+            return false;
+        }
+        unlink(temp_path_.c_str());
+    } else if (rename(temp_path_.c_str(), final_path.c_str()) != 0) {
+        error_ = errno;
+        return false;
+    }
+
+    temp_path_.clear();
+    return true;
+}
+
+}
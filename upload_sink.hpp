@@ -0,0 +1,53 @@
+#ifndef UPLOAD_SINK_H
+#define UPLOAD_SINK_H
+
+#include "utils.hpp"
+#include <string>
+#include <cstddef>
+
+namespace ImageCurry {
+
+constexpr size_t MAGIC_PREFIX_LEN = 16;
+
+// Streams a request body into a temporary file as it arrives, keeping only
+// the first MAGIC_PREFIX_LEN bytes in memory for type detection. The file is
+// removed on destruction unless commit() renamed it into place.
+class UploadSink {
+public:
+    UploadSink() = default;
+    ~UploadSink();
+
+    UploadSink(const UploadSink&) = delete;
+    UploadSink& operator=(const UploadSink&) = delete;
+
+    bool open(const std::string& temp_path);
+    void write(const char* data, size_t len);
+    // With replace false an existing final_path is left alone and the commit
+    // fails with error() EEXIST; the check and the commit are one link().
+    bool commit(const std::string& final_path, bool replace = true);
+
+    // Zero-copy ingestion: the caller moves bytes into fd() itself (splice),
+    // reports them with spliced(), and supplies the magic prefix from a
+    // MSG_PEEK of the socket via peeked() before they are moved.
+    int fd() const { return fd_.get(); }
+    void peeked(const char* data, size_t len);
+    void spliced(size_t len) { size_ += len; }
+    void fail(int error) { error_ = error; }
+
+    size_t size() const { return size_; }
+    const std::string& prefix() const { return prefix_; }
+    bool failed() const { return error_ != 0; }
+    int error() const { return error_; }
+
+private:
+    void record_prefix(const char* data, size_t len);
+
+    ScopedFileDescriptor fd_;
+    std::string temp_path_;
+    std::string prefix_;
+    size_t size_ = 0;
+    int error_ = 0;
+};
+
+}
+#endif
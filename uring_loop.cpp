@@ -0,0 +1,646 @@
+#include "uring_loop.hpp"
+#include "logging.hpp"
+
+#ifdef IMAGECURRY_WITH_IO_URING
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+namespace ImageCurry {
+
+static_assert((URING_BUFFER_COUNT & (URING_BUFFER_COUNT - 1)) == 0,
+              "URING_BUFFER_COUNT must be a power of two");
+
+constexpr uint16_t URING_BUFFER_GROUP = 0;
+constexpr uint64_t NO_OFFSET = static_cast<uint64_t>(-1);
+
+bool io_uring_available() {
+    return true;
+}
+
+static uint64_t user_data(uint64_t id, uint8_t op) {
+    return (id << 8) | op;
+}
+
+UringLoop::UringLoop(int listen_fd) : listen_fd_(listen_fd) {}
+
+UringLoop::~UringLoop() {
+    clients_.clear();
+    ring_fd_.reset();
+    if (buf_ring_) munmap(buf_ring_, buf_ring_size_);
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+}
+
+bool UringLoop::init() {
+    return setup_ring() && setup_buffers() && notifier_.init();
+}
+
+bool UringLoop::setup_ring() {
+    struct io_uring_params params = {};
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+    if (fd < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "io_uring_setup failed: " + std::string(strerror(errno)));
+        return false;
+    }
+    ring_fd_.reset(fd);
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    void* sq = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to map io_uring SQ ring: " + std::string(strerror(errno)));
+        return false;
+    }
+    sq_ptr_ = sq;
+
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        void* cq = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                    "Failed to map io_uring CQ ring: " + std::string(strerror(errno)));
+            return false;
+        }
+        cq_ptr_ = cq;
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to map io_uring SQEs: " + std::string(strerror(errno)));
+        return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq_base = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+    sq_entries_ = *reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_entries);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+
+    char* cq_base = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+    sqe_tail_ = *sq_tail_;
+    return true;
+}
+
+// Registers a ring of receive buffers the kernel picks from when a recv
+// completes, so idle connections do not each pin a buffer.
+bool UringLoop::setup_buffers() {
+    buf_ring_size_ = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring == MAP_FAILED) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to allocate io_uring buffer ring: " + std::string(strerror(errno)));
+        return false;
+    }
+    buf_ring_ = static_cast<struct io_uring_buf*>(ring);
+    buf_ring_tail_ = &buf_ring_[0].resv;
+
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring_fd_.get(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "Failed to register io_uring buffer ring (needs Linux 5.19+): " +
+                std::string(strerror(errno)));
+        return false;
+    }
+
+    buffers_.resize(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    for (unsigned i = 0; i < URING_BUFFER_COUNT; i++) {
+        recycle_buffer(static_cast<uint16_t>(i));
+    }
+    return true;
+}
+
+void UringLoop::recycle_buffer(uint16_t bid) {
+    struct io_uring_buf& buf = buf_ring_[buf_tail_ & (URING_BUFFER_COUNT - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(buffers_.data() + bid * URING_BUFFER_SIZE);
+    buf.len = URING_BUFFER_SIZE;
+    buf.bid = bid;
+    buf_tail_++;
+    __atomic_store_n(buf_ring_tail_, buf_tail_, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* UringLoop::get_sqe() {
+    while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        flush_submissions(0);
+    }
+
+    unsigned index = sqe_tail_ & sq_mask_;
+    sq_array_[index] = index;
+    sqe_tail_++;
+    to_submit_++;
+
+    struct io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void UringLoop::prepare(struct io_uring_sqe* sqe, Op op, uint64_t id) {
+    sqe->user_data = user_data(id, static_cast<uint8_t>(op));
+    inflight_++;
+}
+
+void UringLoop::flush_submissions(unsigned wait_for) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    long ret = syscall(__NR_io_uring_enter, ring_fd_.get(), to_submit_, wait_for, flags,
+                       nullptr, 0);
+    if (ret >= 0) {
+        to_submit_ -= std::min(to_submit_, static_cast<unsigned>(ret));
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                "io_uring_enter failed: " + std::string(strerror(errno)));
+    }
+}
+
+void UringLoop::arm_accept() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    prepare(sqe, Op::ACCEPT, 0);
+    accepting_ = true;
+}
+
+void UringLoop::arm_timeout() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&tick_);
+    sqe->len = 1;
+    prepare(sqe, Op::TIMEOUT, 0);
+}
+
+void UringLoop::arm_notify() {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = notifier_.fd();
+    sqe->addr = reinterpret_cast<uint64_t>(&notify_value_);
+    sqe->len = sizeof(notify_value_);
+    sqe->off = NO_OFFSET;
+    prepare(sqe, Op::NOTIFY, 0);
+}
+
+void UringLoop::arm_recv(uint64_t id, Client& client) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client.conn->fd();
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->len = URING_BUFFER_SIZE;
+    prepare(sqe, Op::RECV, id);
+    client.busy = true;
+}
+
+void UringLoop::arm_open(uint64_t id, Client& client) {
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(client.conn->open_path().c_str());
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    prepare(sqe, Op::OPEN, id);
+    client.busy = true;
+}
+
+// Queues the next piece of the response. Returns false once everything has
+// been sent.
+bool UringLoop::arm_write(uint64_t id, Client& client) {
+    Response& res = client.conn->response();
+    bool file_pending = res.file_remaining > 0 || client.pipe_bytes > 0;
+
+    if (res.data_sent < res.data.size() || res.body_remaining() > 0) {
+        int iov_count = 0;
+        if (res.data_sent < res.data.size()) {
+            client.iov[iov_count].iov_base = const_cast<char*>(res.data.data()) + res.data_sent;
+            client.iov[iov_count].iov_len = res.data.size() - res.data_sent;
+            iov_count++;
+        }
+        if (res.body_remaining() > 0) {
+            client.iov[iov_count].iov_base = const_cast<char*>(res.body->data()) + res.body_sent;
+            client.iov[iov_count].iov_len = res.body_remaining();
+            iov_count++;
+        }
+        client.msg = {};
+        client.msg.msg_iov = client.iov;
+        client.msg.msg_iovlen = iov_count;
+
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = client.conn->fd();
+        sqe->addr = reinterpret_cast<uint64_t>(&client.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (file_pending ? MSG_MORE : 0);
+        prepare(sqe, Op::SEND, id);
+        client.busy = true;
+        return true;
+    }
+
+    if (client.pipe_bytes > 0) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = client.conn->fd();
+        sqe->off = NO_OFFSET;
+        sqe->splice_fd_in = client.pipe_read.get();
+        sqe->splice_off_in = NO_OFFSET;
+        sqe->len = static_cast<unsigned>(client.pipe_bytes);
+        sqe->splice_flags = SPLICE_F_MOVE;
+        prepare(sqe, Op::SPLICE_OUT, id);
+        client.busy = true;
+        return true;
+    }
+
+    if (res.file_remaining > 0) {
+        if (!client.pipe_write) {
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                log_msg(LogLevel::ERROR, client.conn->client_ip(), client.conn->client_port(),
+                        "", "", 0, "Failed to create splice pipe: " + std::string(strerror(errno)));
+                close_client(id, client);
+                return true;
+            }
+            client.pipe_read.reset(fds[0]);
+            client.pipe_write.reset(fds[1]);
+            fcntl(client.pipe_write.get(), F_SETPIPE_SZ, static_cast<int>(URING_SPLICE_CHUNK));
+        }
+
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->fd = client.pipe_write.get();
+        sqe->off = NO_OFFSET;
+        sqe->splice_fd_in = res.file.get();
+        sqe->splice_off_in = static_cast<uint64_t>(res.file_offset);
+        sqe->len = static_cast<unsigned>(std::min(res.file_remaining, URING_SPLICE_CHUNK));
+        sqe->splice_flags = SPLICE_F_MOVE;
+        prepare(sqe, Op::SPLICE_IN, id);
+        client.busy = true;
+        return true;
+    }
+
+    return false;
+}
+
+// Issues the next operation for a connection, completing any steps that
+// need no I/O (a finished response, an idle state change) inline.
+void UringLoop::drive(uint64_t id, Client& client) {
+    while (!client.busy && !client.closing) {
+        Connection& conn = *client.conn;
+        switch (conn.state()) {
+            case ConnectionState::READING_HEADERS:
+            case ConnectionState::READING_BODY:
+                arm_recv(id, client);
+                return;
+            case ConnectionState::OPENING:
+                arm_open(id, client);
+                return;
+            case ConnectionState::ENCODING:
+                return;
+            case ConnectionState::WRITING:
+                if (arm_write(id, client)) {
+                    return;
+                }
+                conn.on_response_sent();
+                break;
+            case ConnectionState::CLOSED:
+                close_client(id, client);
+                return;
+        }
+    }
+}
+
+void UringLoop::run(const volatile sig_atomic_t& running) {
+    running_ = &running;
+    arm_accept();
+    arm_timeout();
+    arm_notify();
+
+    while (running) {
+        flush_submissions(1);
+
+        reap_completions();
+    }
+
+    shutdown_all();
+}
+
+void UringLoop::reap_completions() {
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = cqes_[head & cq_mask_];
+        head++;
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        handle_completion(cqe);
+    }
+}
+
+void UringLoop::handle_completion(const struct io_uring_cqe& cqe) {
+    uint64_t id = cqe.user_data >> 8;
+    Op op = static_cast<Op>(cqe.user_data & 0xff);
+
+    bool more = (op == Op::ACCEPT) && (cqe.flags & IORING_CQE_F_MORE);
+    if (!more) {
+        inflight_--;
+    }
+
+    if (id == 0) {
+        if (op == Op::ACCEPT) {
+            if (cqe.res >= 0) {
+                on_accept(cqe.res);
+            } else if (cqe.res != -ECANCELED && cqe.res != -EINTR) {
+                log_msg(LogLevel::ERROR, "", 0, "", "", 0,
+                        "Accept failed: " + std::string(strerror(-cqe.res)));
+            }
+            if (!more) {
+                accepting_ = false;
+                if (*running_) arm_accept();
+            }
+        } else if (op == Op::TIMEOUT) {
+            close_idle(time(nullptr));
+            if (*running_) arm_timeout();
+        } else if (op == Op::NOTIFY) {
+            wake_waiters();
+            if (*running_) arm_notify();
+        }
+        return;
+    }
+
+    auto it = clients_.find(id);
+    if (it == clients_.end()) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            recycle_buffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        return;
+    }
+
+    Client& client = it->second;
+    Connection& conn = *client.conn;
+    client.busy = false;
+
+    if (client.closing) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            recycle_buffer(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        if (op == Op::OPEN && cqe.res >= 0) {
+            close(cqe.res);
+        }
+        close_client(id, client);
+        return;
+    }
+
+    Response& res = conn.response();
+    switch (op) {
+        case Op::RECV:
+            on_recv(id, client, cqe);
+            return;
+
+        case Op::SEND: {
+            if (cqe.res < 0) {
+                if (cqe.res == -EINTR || cqe.res == -EAGAIN) break;
+                if (cqe.res != -EPIPE && cqe.res != -ECONNRESET) {
+                    log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                            "Failed to send response: " + std::string(strerror(-cqe.res)));
+                }
+                close_client(id, client);
+                return;
+            }
+            size_t sent = static_cast<size_t>(cqe.res);
+            size_t header_part = std::min(sent, res.data.size() - res.data_sent);
+            res.data_sent += header_part;
+            res.body_sent += sent - header_part;
+            conn.touch(time(nullptr));
+            break;
+        }
+
+        case Op::SPLICE_IN:
+            if (cqe.res <= 0) {
+                log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                        cqe.res == 0 ? "File truncated while sending at offset " +
+                                       std::to_string(res.file_offset)
+                                     : "Failed to read file: " + std::string(strerror(-cqe.res)));
+                close_client(id, client);
+                return;
+            }
+            res.file_offset += cqe.res;
+            res.file_remaining -= static_cast<size_t>(cqe.res);
+            client.pipe_bytes = static_cast<size_t>(cqe.res);
+            break;
+
+        case Op::SPLICE_OUT:
+            if (cqe.res < 0) {
+                if (cqe.res == -EINTR || cqe.res == -EAGAIN) break;
+                if (cqe.res != -EPIPE && cqe.res != -ECONNRESET) {
+                    log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                            "Failed to send data at offset " + std::to_string(res.file_offset) +
+                            ": " + std::string(strerror(-cqe.res)));
+                }
+                close_client(id, client);
+                return;
+            }
+            client.pipe_bytes -= static_cast<size_t>(cqe.res);
+            conn.touch(time(nullptr));
+            break;
+
+        case Op::OPEN:
+            if (cqe.res < 0) {
+                conn.on_file_opened(ScopedFileDescriptor(), {});
+                break;
+            }
+            client.opened.reset(cqe.res);
+            {
+                struct io_uring_sqe* sqe = get_sqe();
+                sqe->opcode = IORING_OP_STATX;
+                sqe->fd = client.opened.get();
+                sqe->addr = reinterpret_cast<uint64_t>("");
+                sqe->statx_flags = AT_EMPTY_PATH;
+                sqe->len = STATX_SIZE | STATX_MTIME | STATX_INO;
+                sqe->off = reinterpret_cast<uint64_t>(&client.stx);
+                prepare(sqe, Op::STATX, id);
+                client.busy = true;
+            }
+            return;
+
+        case Op::STATX: {
+            struct stat st = {};
+            ScopedFileDescriptor file(client.opened.release());
+            if (cqe.res < 0) {
+                file.reset();
+            } else {
+                st.st_size = static_cast<off_t>(client.stx.stx_size);
+                st.st_mtime = client.stx.stx_mtime.tv_sec;
+                st.st_ino = client.stx.stx_ino;
+                st.st_mode = client.stx.stx_mode;
+            }
+            conn.on_file_opened(std::move(file), st);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    drive(id, client);
+}
+
+void UringLoop::on_recv(uint64_t id, Client& client, const struct io_uring_cqe& cqe) {
+    Connection& conn = *client.conn;
+
+    if (cqe.res == -ENOBUFS || cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        drive(id, client);
+        return;
+    }
+    if (cqe.res <= 0) {
+        if (cqe.res < 0 && cqe.res != -ECONNRESET) {
+            log_msg(LogLevel::ERROR, conn.client_ip(), conn.client_port(), "", "", 0,
+                    "Receive error: " + std::string(strerror(-cqe.res)));
+        }
+        close_client(id, client);
+        return;
+    }
+
+    uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    conn.touch(time(nullptr));
+    conn.on_input(buffers_.data() + bid * URING_BUFFER_SIZE, static_cast<size_t>(cqe.res));
+    recycle_buffer(bid);
+    drive(id, client);
+}
+
+void UringLoop::on_accept(int fd) {
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    char client_ip[INET_ADDRSTRLEN] = "";
+    int client_port = 0;
+    if (getpeername(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) == 0) {
+        inet_ntop(AF_INET, &addr.sin_addr, client_ip, sizeof(client_ip));
+        client_port = ntohs(addr.sin_port);
+    }
+
+    uint64_t id = next_id_++;
+    Client& client = clients_[id];
+    client.conn = std::make_unique<Connection>(fd, std::string(client_ip), client_port,
+                                               notifier_, id);
+    drive(id, client);
+}
+
+void UringLoop::wake_waiters() {
+    for (auto& ticket : notifier_.drain()) {
+        auto it = clients_.find(ticket->key);
+        if (it != clients_.end() && it->second.conn->waiting_on(ticket.get())) {
+            it->second.conn->on_encoded();
+            drive(it->first, it->second);
+        }
+    }
+}
+
+// A connection with an operation in flight cannot be freed until it
+// completes; shutting the socket down makes pending socket operations finish
+// promptly, and the completion handler then erases it.
+void UringLoop::close_client(uint64_t id, Client& client) {
+    if (client.busy) {
+        if (!client.closing) {
+            client.closing = true;
+            shutdown(client.conn->fd(), SHUT_RDWR);
+        }
+        return;
+    }
+    clients_.erase(id);
+}
+
+void UringLoop::close_idle(time_t now) {
+    std::vector<uint64_t> waiting;
+    for (auto& entry : clients_) {
+        if (!entry.second.closing && entry.second.conn->wait_expired(now)) {
+            waiting.push_back(entry.first);
+        }
+    }
+    for (uint64_t id : waiting) {
+        clients_[id].conn->on_wait_timeout();
+        drive(id, clients_[id]);
+    }
+
+    std::vector<uint64_t> expired;
+    for (auto& entry : clients_) {
+        if (!entry.second.closing && entry.second.conn->timed_out(now)) {
+            expired.push_back(entry.first);
+        }
+    }
+    for (uint64_t id : expired) {
+        close_client(id, clients_[id]);
+    }
+}
+
+void UringLoop::shutdown_all() {
+    if (accepting_) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(0, static_cast<uint8_t>(Op::ACCEPT));
+        prepare(sqe, Op::CANCEL, 0);
+    }
+    for (Op op : {Op::TIMEOUT, Op::NOTIFY}) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = user_data(0, static_cast<uint8_t>(op));
+        prepare(sqe, Op::CANCEL, 0);
+    }
+
+    std::vector<uint64_t> ids;
+    for (auto& entry : clients_) {
+        ids.push_back(entry.first);
+    }
+    for (uint64_t id : ids) {
+        close_client(id, clients_[id]);
+    }
+
+    while (inflight_ > 0) {
+        flush_submissions(1);
+        reap_completions();
+    }
+    clients_.clear();
+}
+
+}
+
+#else
+
+namespace ImageCurry {
+
+bool io_uring_available() {
+    return false;
+}
+
+}
+
+#endif
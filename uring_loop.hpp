@@ -0,0 +1,141 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "connection.hpp"
+#include "io_engine.hpp"
+#include "loop_notifier.hpp"
+#include "utils.hpp"
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#ifdef IMAGECURRY_WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace ImageCurry {
+
+constexpr unsigned URING_ENTRIES = 1024;
+constexpr unsigned URING_BUFFER_COUNT = 128;        // must be a power of two
+constexpr size_t URING_BUFFER_SIZE = 16 * 1024;
+constexpr size_t URING_SPLICE_CHUNK = 256 * 1024;
+
+bool io_uring_available();
+
+#ifdef IMAGECURRY_WITH_IO_URING
+
+// io_uring engine, driven through the raw system calls (no liburing):
+// multishot accept, recv into a registered provided-buffer ring, sendmsg of
+// header plus cached body, file bodies spliced file -> pipe -> socket, and
+// openat/statx so a cache miss in /retrieve never blocks the loop. Each
+// connection has at most one operation in flight, which keeps the same
+// read/write back-pressure as the epoll engine.
+class UringLoop : public IoEngine {
+public:
+    explicit UringLoop(int listen_fd);
+    ~UringLoop() override;
+
+    UringLoop(const UringLoop&) = delete;
+    UringLoop& operator=(const UringLoop&) = delete;
+
+    bool init() override;
+    void run(const volatile sig_atomic_t& running) override;
+
+private:
+    enum class Op : uint8_t {
+        ACCEPT, TIMEOUT, NOTIFY, CANCEL, RECV, SEND, OPEN, STATX, SPLICE_IN, SPLICE_OUT
+    };
+
+    struct Client {
+        std::unique_ptr<Connection> conn;
+        bool busy = false;          // an operation is in flight
+        bool closing = false;
+
+        // Storage the kernel reads or writes while an operation is pending.
+        struct msghdr msg = {};
+        struct iovec iov[2] = {};
+        struct statx stx = {};
+        ScopedFileDescriptor opened;
+
+        // File bodies pass through this pipe; pipe_bytes are still in it.
+        ScopedFileDescriptor pipe_read;
+        ScopedFileDescriptor pipe_write;
+        size_t pipe_bytes = 0;
+    };
+
+    bool setup_ring();
+    bool setup_buffers();
+    struct io_uring_sqe* get_sqe();
+    void flush_submissions(unsigned wait_for);
+    void prepare(struct io_uring_sqe* sqe, Op op, uint64_t id);
+
+    void arm_accept();
+    void arm_timeout();
+    void arm_notify();
+    void arm_recv(uint64_t id, Client& client);
+    bool arm_write(uint64_t id, Client& client);
+    void arm_open(uint64_t id, Client& client);
+
+    void reap_completions();
+    void handle_completion(const struct io_uring_cqe& cqe);
+    void on_accept(int fd);
+    void wake_waiters();
+    void on_recv(uint64_t id, Client& client, const struct io_uring_cqe& cqe);
+    void drive(uint64_t id, Client& client);
+    void recycle_buffer(uint16_t bid);
+    void close_client(uint64_t id, Client& client);
+    void close_idle(time_t now);
+    void shutdown_all();
+
+    int listen_fd_;
+    ScopedFileDescriptor ring_fd_;
+    const volatile sig_atomic_t* running_ = nullptr;
+
+    // Mapped rings.
+    void* sq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    void* cq_ptr_ = nullptr;
+    size_t cq_size_ = 0;
+    struct io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    struct io_uring_cqe* cqes_ = nullptr;
+    unsigned sqe_tail_ = 0;         // local tail, published on submit
+    unsigned to_submit_ = 0;
+
+    // Provided buffer ring for recv. Addressed as a plain io_uring_buf array:
+    // in C++ the flexible array in struct io_uring_buf_ring is preceded by an
+    // empty struct of size 1, which shifts it away from the kernel's layout.
+    // The ring tail overlays the resv field of the first entry.
+    struct io_uring_buf* buf_ring_ = nullptr;
+    uint16_t* buf_ring_tail_ = nullptr;
+    size_t buf_ring_size_ = 0;
+    std::vector<char> buffers_;
+    uint16_t buf_tail_ = 0;
+
+    struct __kernel_timespec tick_ = {1, 0};
+    LoopNotifier notifier_;
+    uint64_t notify_value_ = 0;     // eventfd counter read by the NOTIFY op
+    size_t inflight_ = 0;
+    bool accepting_ = false;
+    uint64_t next_id_ = 1;
+    std::unordered_map<uint64_t, Client> clients_;
+};
+
+#endif
+
+}
+#endif
@@ -8,10 +8,11 @@
 #include <random>
 #include <cstring>
 #include <chrono>
+#include <unistd.h>
 
 namespace ImageCurry {
 
-std::string url_decode(const std::string& src) {
+std::string url_decode(std::string_view src) {
     std::string result;
     result.reserve(src.size());
 
@@ -60,24 +61,22 @@ bool valid_filename(const std::string& name) {
     });
 }
 
-bool get_query_param(const std::string& query, const std::string& key,
+bool get_query_param(std::string_view query, std::string_view key,
                      std::string& value) {
-    std::string search = key + "=";
+    // Only whole keys count: "w" must not match inside "view=".
+    std::string search = std::string(key) + "=";
     auto pos = query.find(search);
+    while (pos != std::string_view::npos && pos > 0 && query[pos - 1] != '&') {
+        pos = query.find(search, pos + 1);
+    }
 
-    if (pos == std::string::npos) {
+    if (pos == std::string_view::npos) {
         return false;
     }
 
     size_t start = pos + search.size();
     size_t end = query.find_first_of(" &\r\n", start);
-
-    std::string encoded;
-    if (end != std::string::npos) {
-        encoded = query.substr(start, end - start);
-    } else {
-        encoded = query.substr(start);
-    }
+    std::string_view encoded = query.substr(start, end - start);
 
     if (encoded.empty()) {
         return false;
@@ -142,10 +141,30 @@ std::string build_serve_path(const std::string& filename) {
     return std::string(SERVE_DIR) + "/" + filename;
 }
 
+std::string build_derived_path(const std::string& filename) {
+    return std::string(DERIVED_DIR) + "/" + filename;
+}
+
+std::string variant_name(const std::string& webp_name, int width) {
+    return webp_name.substr(0, webp_name.size() - 5) + ".w" + std::to_string(width) + ".webp";
+}
+
 std::string build_save_path(const std::string& filename) {
     return std::string(SAVE_DIR) + "/" + filename;
 }
 
+// Originals keep the upload's extension, which the WebP name does not carry.
+std::string find_original(const std::string& webp_name) {
+    std::string uuid = webp_name.substr(0, webp_name.size() - 5);   // strip ".webp"
+    for (const char* ext : UPLOAD_EXTENSIONS) {
+        std::string path = build_save_path(uuid + ext);
+        if (access(path.c_str(), F_OK) == 0) {
+            return path;
+        }
+    }
+    return "";
+}
+
 std::string generate_sha256_uuid() {
     auto now = std::chrono::system_clock::now();
     auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
@@ -189,7 +208,8 @@ std::string detect_extension_from_magic(const std::string& body) {
     if (data[0] == 0x89 && data[1] == 0x50 && data[2] == 0x4E && data[3] == 0x47) {
         return ".png";
     }
-    if (data[0] == 'R' && data[1] == 'I' && data[2] == 'F' && data[3] == 'F' &&
+    if (body.size() >= 12 &&
+        data[0] == 'R' && data[1] == 'I' && data[2] == 'F' && data[3] == 'F' &&
         data[8] == 'W' && data[9] == 'E' && data[10] == 'B' && data[11] == 'P') {
         return ".webp";
     }
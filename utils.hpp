@@ -2,24 +2,74 @@
 #define UTILS_H
 
 #include <string>
+#include <string_view>
 #include <ctime>
 #include <sys/stat.h>
+#include <unistd.h>
 
 namespace ImageCurry {
 
 constexpr size_t MAX_FILENAME_LEN = 255;
+// Every extension an upload can be saved with (see detect_extension_*).
+constexpr const char* UPLOAD_EXTENSIONS[] = {".jpg", ".png", ".gif", ".webp", ".pdf", ".zip", ".bin"};
 constexpr const char* SERVE_DIR = "./serve";
 constexpr const char* SAVE_DIR = "./save";
+constexpr const char* DERIVED_DIR = "./derived";     // on-the-fly resizes
+// Object cache keys of DERIVED_DIR files; the '/' keeps them apart from
+// serve-directory names, which can never contain one.
+constexpr const char* DERIVED_CACHE_PREFIX = "derived/";
 
-std::string url_decode(const std::string& src);
+class ScopedFileDescriptor {
+public:
+    explicit ScopedFileDescriptor(int fd = -1) : fd_(fd) {}
+    ~ScopedFileDescriptor() { close_fd(); }
+
+    ScopedFileDescriptor(const ScopedFileDescriptor&) = delete;
+    ScopedFileDescriptor& operator=(const ScopedFileDescriptor&) = delete;
+
+    ScopedFileDescriptor(ScopedFileDescriptor&& other) noexcept : fd_(other.fd_) {
+        other.fd_ = -1;
+    }
+
+    ScopedFileDescriptor& operator=(ScopedFileDescriptor&& other) noexcept {
+        if (this != &other) {
+            close_fd();
+            fd_ = other.fd_;
+            other.fd_ = -1;
+        }
+        return *this;
+    }
+
+    int get() const { return fd_; }
+    int release() { int tmp = fd_; fd_ = -1; return tmp; }
+    void reset(int fd = -1) { close_fd(); fd_ = fd; }
+    explicit operator bool() const { return fd_ >= 0; }
+
+private:
+    void close_fd() {
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_;
+};
+
+std::string url_decode(std::string_view src);
 bool valid_filename(const std::string& name);
-bool get_query_param(const std::string& query, const std::string& key,
+bool get_query_param(std::string_view query, std::string_view key,
                      std::string& value);
 std::string format_http_date(time_t t);
 std::string generate_etag(const struct stat& st);
 std::string get_content_type(const std::string& filename);
 std::string build_serve_path(const std::string& filename);
 std::string build_save_path(const std::string& filename);
+std::string build_derived_path(const std::string& filename);
+// "<uuid>.webp" -> "<uuid>.w<width>.webp", the name of a --variants output.
+std::string variant_name(const std::string& webp_name, int width);
+// SAVE_DIR path of the upload "<uuid>.webp" is encoded from, or "" if none.
+std::string find_original(const std::string& webp_name);
 std::string generate_sha256_uuid();
 std::string detect_extension_from_magic(const std::string& body);
 std::string detect_extension_from_content_type(const std::string& content_type);